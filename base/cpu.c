@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/syscall.h>
 
 #include <base/stddef.h>
@@ -116,6 +117,28 @@ static int cpu_scan_topology(void)
             l2_count++;
         }
 
+        /* try out the L3 cache index, not every CPU has one */
+        bool has_l3 = false;
+        for (idx = 0; 4 > idx; ++idx) {
+            snprintf(path, sizeof(path), SYSFS_CPU_CACHE_PATH
+                 "/level", i, idx);
+            if (sysfs_parse_val(path, &tmp))
+                break;
+            if (3 == tmp) {
+                has_l3 = true;
+                break;
+            }
+        }
+        snprintf(path, sizeof(path), SYSFS_CPU_CACHE_PATH
+             "/shared_cpu_list", i, idx);
+        if (!has_l3 || sysfs_parse_bitlist(path,
+            cpu_info_tbl[i].llc_siblings_mask, cpu_count)) {
+            /* treat the package as the last level of sharing */
+            memcpy(cpu_info_tbl[i].llc_siblings_mask,
+                   cpu_info_tbl[i].core_siblings_mask,
+                   sizeof(cpu_info_tbl[i].llc_siblings_mask));
+        }
+
         snprintf(path, sizeof(path), SYSFS_CPU_TOPOLOGY_PATH
              "/thread_siblings_list", i);
         if (sysfs_parse_bitlist(path,
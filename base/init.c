@@ -53,13 +53,17 @@ void __weak init_shutdown(int status)
 /**
  * base_init - initializes the base library
  *
- * Call this function before using the library.
+ * Call this function before using the library. Later calls do nothing, so an
+ * in-process hwallocd and the runtime can share the library.
  * Returns 0 if successful, otherwise fail.
  */
 int base_init(void)
 {
     int ret;
 
+    if (base_init_done)
+        return 0;
+
     ret = run_init_handlers("base", base_init_handlers,
             ARRAY_SIZE(base_init_handlers));
     if (ret)
@@ -69,3 +69,49 @@ int lrpc_init_in(struct lrpc_chan_in *chan, struct lrpc_msg *tbl,
     chan->recv_head_wb = recv_head_wb;
     return 0;
 }
+
+/**
+ * lrpc_line_init_out - initializes an egress cache line channel
+ * @chan: the channel struct to initialize
+ * @tbl: a buffer to store channel messages
+ * @size: the number of cache line slots in the buffer
+ * @recv_head_wb: a pointer to the head position of the receiver
+ *
+ * returns 0 if successful, or -EINVAL if @size is not a power of two or can't
+ * hold the largest message.
+ */
+int lrpc_line_init_out(struct lrpc_line_chan_out *chan, struct lrpc_line *tbl,
+               unsigned int size, uint32_t *recv_head_wb)
+{
+    if (!is_power_of_two(size) || size < LRPC_LINE_MAX_SLOTS)
+        return -EINVAL;
+
+    memset(chan, 0, sizeof(*chan));
+    chan->tbl = tbl;
+    chan->size = size;
+    chan->recv_head_wb = recv_head_wb;
+    return 0;
+}
+
+/**
+ * lrpc_line_init_in - initializes an ingress cache line channel
+ * @chan: the channel struct to initialize
+ * @tbl: a buffer to store channel messages
+ * @size: the number of cache line slots in the buffer
+ * @recv_head_wb: a pointer to the head position of the receiver
+ *
+ * returns 0 if successful, or -EINVAL if @size is not a power of two or can't
+ * hold the largest message.
+ */
+int lrpc_line_init_in(struct lrpc_line_chan_in *chan, struct lrpc_line *tbl,
+              unsigned int size, uint32_t *recv_head_wb)
+{
+    if (!is_power_of_two(size) || size < LRPC_LINE_MAX_SLOTS)
+        return -EINVAL;
+
+    memset(chan, 0, sizeof(*chan));
+    chan->tbl = tbl;
+    chan->size = size;
+    chan->recv_head_wb = recv_head_wb;
+    return 0;
+}
@@ -11,8 +11,16 @@
  * The SLAB allocator is designed for simplicity rather than for multicore
  * scalability. When scalability is required use the thread-local cache on top
  * of the SLAB allocator.
+ *
+ * Slabs created with SLAB_FLAG_SCALABLE additionally give each thread its own
+ * slab node, similar to the per-CPU slabs of SLUB or mimalloc's thread-local
+ * heaps. The owning thread allocates and frees without taking a lock; other
+ * threads push freed items onto the owner's remote free list, which the owner
+ * drains when it runs out of items. Like the thread-local cache, the calling
+ * thread must not migrate (e.g. be preempted) in the middle of an operation.
  */
 
+#include <stdlib.h>
 #include <string.h>
 
 #include <base/slab.h>
@@ -65,6 +73,7 @@ __slab_create_node(struct slab_node *n, int numa_node,
     n->cur_pg = NULL;
     n->pg_off = 0;
     n->nr_pages = 0;
+    atomic64_write(&n->remote_free, 0);
 
     spin_lock_init(&n->page_lock);
     list_head_init(&n->full_list);
@@ -99,6 +108,13 @@ __slab_create(struct slab *s, const char *name, size_t size,
         s->nodes[i] = n;
     }
 
+    s->locals = NULL;
+    if (flags & SLAB_FLAG_SCALABLE) {
+        s->locals = calloc(NTHREAD, sizeof(*s->locals));
+        if (!s->locals)
+            goto fail;
+    }
+
     spin_lock(&slab_lock);
     list_add_tail(&slab_list, &s->link);
     spin_unlock(&slab_lock);
@@ -123,6 +139,7 @@ __slab_early_create(struct slab *s, struct slab_node *nodes,
         __slab_create_node(&nodes[i], i, size, offset, flags, nr_elems);
         s->nodes[i] = &nodes[i];
     }
+    s->locals = NULL;
 
     spin_lock(&slab_lock);
     list_add(&slab_list, &s->link);
@@ -208,6 +225,17 @@ void slab_destroy(struct slab *s)
         __slab_destroy_node(s->nodes[i]);
         slab_free(&node_slab, s->nodes[i]);
     }
+
+    if (!s->locals)
+        return;
+
+    for (i = 0; i < NTHREAD; i++) {
+        if (!s->locals[i])
+            continue;
+        __slab_destroy_node(s->locals[i]);
+        slab_free(&node_slab, s->locals[i]);
+    }
+    free(s->locals);
 }
 
 #ifdef DEBUG
@@ -291,7 +319,7 @@ static void *__slab_node_alloc(struct slab_node *n)
 {
     struct slab_hdr *hdr;
 
-    assert_spin_lock_held(&n->page_lock);
+    assert((n->flags & SLAB_FLAG_LOCAL) || spin_lock_held(&n->page_lock));
 
     if (!n->cur_pg || !n->cur_pg->item_count) {
         if (n->cur_pg)
@@ -319,55 +347,43 @@ static void *__slab_node_alloc(struct slab_node *n)
     return (void *)hdr;
 }
 
-/**
- * slab_alloc_on_node - allocates an item from a slab
- * @s: the slab
- * @numa_node: the numa node
- *
- * Returns an item, or NULL if out of memory.
- */
-void *slab_alloc_on_node(struct slab *s, int numa_node)
+static inline struct page *slab_item_to_page(struct slab_node *n, void *item)
 {
-    struct slab_node *n = s->nodes[numa_node];
-    void *item;
-
-    spin_lock(&n->page_lock);
-    item = __slab_node_alloc(n);
-    spin_unlock(&n->page_lock);
-
-    slab_alloc_check(n, item);
-
-    return item;
+    if (n->flags & SLAB_FLAG_LGPAGE)
+        return addr_to_lgpage(item);
+    return addr_to_smpage(item);
 }
 
-static void slab_node_free(struct slab_node *n, void *item)
+/* returns true if the page became empty and must be released */
+static bool __slab_node_free(struct slab_node *n, struct page *pg, void *item)
 {
-    struct page *pg;
     struct slab_hdr *hdr = (struct slab_hdr *)item;
-    bool free = false;
 
-    if (n->flags & SLAB_FLAG_LGPAGE)
-        pg = addr_to_lgpage(item);
-    else
-        pg = addr_to_smpage(item);
-
-    spin_lock(&n->page_lock);
     hdr->next_hdr = pg->next;
     pg->next = hdr;
     pg->item_count++;
 
-    if (pg == n->cur_pg) {
-        spin_unlock(&n->page_lock);
-        return;
-    }
+    if (pg == n->cur_pg)
+        return false;
 
     if (pg->item_count == SLAB_PARTIAL_THRESH) {
         list_del(&pg->link);
         list_add(&n->partial_list, &pg->link);
     } else if (pg->item_count == n->nr_elems) {
         list_del(&pg->link);
-        free = true;
+        return true;
     }
+
+    return false;
+}
+
+static void slab_node_free(struct slab_node *n, void *item)
+{
+    struct page *pg = slab_item_to_page(n, item);
+    bool free;
+
+    spin_lock(&n->page_lock);
+    free = __slab_node_free(n, pg, item);
     spin_unlock(&n->page_lock);
 
     if (free) {
@@ -376,6 +392,110 @@ static void slab_node_free(struct slab_node *n, void *item)
     }
 }
 
+
+/*
+ * Per-thread slab nodes (SLAB_FLAG_SCALABLE)
+ */
+
+/* gets (or lazily creates) the calling thread's slab node */
+static struct slab_node *slab_local_node(struct slab *s)
+{
+    struct slab_node *n = s->locals[thread_id];
+    struct slab_node *global;
+
+    if (likely(n))
+        return n;
+
+    n = (struct slab_node *)slab_alloc_on_node(&node_slab, thread_numa_node);
+    if (unlikely(!n))
+        return NULL;
+
+    global = s->nodes[thread_numa_node];
+    __slab_create_node(n, thread_numa_node, global->size, global->offset,
+               global->flags | SLAB_FLAG_LOCAL, global->nr_elems);
+    store_release(&s->locals[thread_id], n);
+    return n;
+}
+
+static void slab_local_free(struct slab_node *n, void *item)
+{
+    struct page *pg = slab_item_to_page(n, item);
+
+    if (__slab_node_free(n, pg, item)) {
+        page_put(pg);
+        n->nr_pages--;
+    }
+}
+
+static void slab_remote_free(struct slab_node *n, void *item)
+{
+    struct slab_hdr *hdr = (struct slab_hdr *)item;
+    long head;
+
+    do {
+        head = atomic64_read(&n->remote_free);
+        hdr->next_hdr = (struct slab_hdr *)head;
+    } while (!atomic64_cmpxchg(&n->remote_free, head, (long)hdr));
+}
+
+/* takes back every item other threads have freed to this node */
+static void slab_local_drain(struct slab_node *n)
+{
+    struct slab_hdr *hdr, *next;
+    long head;
+
+    do {
+        head = atomic64_read(&n->remote_free);
+    } while (head && !atomic64_cmpxchg(&n->remote_free, head, 0));
+
+    for (hdr = (struct slab_hdr *)head; hdr; hdr = next) {
+        next = hdr->next_hdr;
+        slab_local_free(n, hdr);
+    }
+}
+
+static void *slab_local_alloc(struct slab_node *n)
+{
+    /* prefer recycling remotely freed items over taking another page */
+    if ((!n->cur_pg || !n->cur_pg->item_count) &&
+        atomic64_read(&n->remote_free))
+        slab_local_drain(n);
+
+    return __slab_node_alloc(n);
+}
+
+/**
+ * slab_alloc_on_node - allocates an item from a slab
+ * @s: the slab
+ * @numa_node: the numa node
+ *
+ * Returns an item, or NULL if out of memory.
+ */
+void *slab_alloc_on_node(struct slab *s, int numa_node)
+{
+    struct slab_node *n;
+    void *item;
+
+    if (s->locals && likely(thread_init_done) &&
+        numa_node == thread_numa_node) {
+        n = slab_local_node(s);
+        if (likely(n)) {
+            item = slab_local_alloc(n);
+            slab_alloc_check(n, item);
+            return item;
+        }
+    }
+
+    n = s->nodes[numa_node];
+    spin_lock(&n->page_lock);
+    item = __slab_node_alloc(n);
+    spin_unlock(&n->page_lock);
+
+    slab_alloc_check(n, item);
+
+    return item;
+}
+
 /**
  * slab_free frees an item to a slab
  * @s: the slab
@@ -384,16 +504,55 @@ static void slab_node_free(struct slab_node *n, void *item)
 void slab_free(struct slab *s, void *item)
 {
     struct slab_node *n = s->nodes[addr_to_numa_node(item)];
+
+    if (s->locals) {
+        /* the page knows which node (global or per-thread) owns it */
+        n = slab_item_to_page(n, item)->snode;
+        if (n->flags & SLAB_FLAG_LOCAL) {
+            slab_free_check(n, item);
+            if (likely(thread_init_done) && n == s->locals[thread_id])
+                slab_local_free(n, item);
+            else
+                slab_remote_free(n, item);
+            return;
+        }
+    }
+
     slab_free_check(n, item);
     slab_node_free(n, item);
 }
 
+static int slab_tcache_alloc_local(struct slab *s, int nr, void **items)
+{
+    struct slab_node *n = slab_local_node(s);
+    int i;
+
+    if (unlikely(!n))
+        return -ENOMEM;
+
+    for (i = 0; i < nr; i++) {
+        items[i] = slab_local_alloc(n);
+        if (unlikely(!items[i]))
+            goto fail;
+    }
+
+    return 0;
+
+fail:
+    for (i--; i >= 0; i--)
+        slab_local_free(n, items[i]);
+    return -ENOMEM;
+}
+
 static int slab_tcache_alloc(struct tcache *tc, int nr, void **items)
 {
     struct slab *s = (struct slab *)tc->data;
     struct slab_node *n = s->nodes[thread_numa_node];
     int i;
 
+    if (s->locals)
+        return slab_tcache_alloc_local(s, nr, items);
+
     spin_lock(&n->page_lock);
     for (i = 0; i < nr; i++) {
         items[i] = __slab_node_alloc(n);
@@ -418,6 +577,13 @@ static void slab_tcache_free(struct tcache *tc, int nr, void **items)
     struct slab_node *n = s->nodes[thread_numa_node];
     int i;
 
+    /* magazines mix items from many threads, so look up each owner */
+    if (s->locals) {
+        for (i = 0; i < nr; i++)
+            slab_free(s, items[i]);
+        return;
+    }
+
     for (i = 0; i < nr; i++)
         slab_node_free(n, items[i]);
 
@@ -471,6 +637,18 @@ void slab_print_usage(void)
             }
         }
 
+        /* per-thread nodes are read racily, which is fine for statistics */
+        for (i = 0; s->locals && i < NTHREAD; i++) {
+            struct slab_node *n = ACCESS_ONCE(s->locals[i]);
+            size_t pgsize;
+
+            if (!n)
+                continue;
+            pgsize = (n->flags & SLAB_FLAG_LGPAGE) ? PGSIZE_2MB : PGSIZE_4KB;
+            usage += ACCESS_ONCE(n->nr_pages) * pgsize;
+            total += ACCESS_ONCE(n->nr_pages) * pgsize;
+        }
+
         log_info("%8ld KB\t%s", usage / 1024, s->name);
     }
     spin_unlock(&slab_lock);
@@ -52,32 +52,24 @@ out:
 }
 
 /**
- * sysfs_parse_bitlist - parses a bitlist value from a sysfs file
- * @path: the sysfs file path
+ * parse_bitlist - parses a bitlist string (e.g. "0-3,8,10-11")
+ * @str: the string to parse, optionally terminated by a newline
  * @bits: the bitmap to store the result
  * @nbits: the number of bits in the bitmap
  *
+ * An empty string yields an empty bitmap.
+ *
  * Returns 0 if successful, otherwise fail.
  */
-int sysfs_parse_bitlist(const char *path, unsigned long *bits, int nbits)
+int parse_bitlist(const char *str, unsigned long *bits, int nbits)
 {
-    FILE *f;
-    char buf[BUFSIZ];
-    char *pos, *end;
-    int ret = 0, bit_start, bit_end;
+    const char *pos;
+    char *end;
+    int bit_start, bit_end;
     uint64_t val;
 
-    f = fopen(path, "r");
-    if (!f)
-        return -EIO;
-
-    if (!fgets(buf, sizeof(buf), f)) {
-        ret = -EIO;
-        goto out;
-    }
-
     bitmap_init(bits, nbits, false);
-    pos = &buf[0];
+    pos = str;
     while (*pos != '\0' && *pos != '\n') {
         if (*pos == ',') {
             pos++;
@@ -85,18 +77,12 @@ int sysfs_parse_bitlist(const char *path, unsigned long *bits, int nbits)
         }
 
         val = strtoull(pos, &end, 0);
-        if (val == ULLONG_MAX) {
-            ret = -errno;
-            goto out;
-        }
-        if (end == pos) {
-            ret = -EINVAL;
-            goto out;
-        }
-        if (val > INT_MAX) {
-            ret = -ERANGE;
-            goto out;
-        }
+        if (val == ULLONG_MAX)
+            return -errno;
+        if (end == pos)
+            return -EINVAL;
+        if (val > INT_MAX)
+            return -ERANGE;
 
         bit_start = (int)val;
         pos = end;
@@ -104,18 +90,12 @@ int sysfs_parse_bitlist(const char *path, unsigned long *bits, int nbits)
             pos++;
 
             val = strtoull(pos, &end, 0);
-            if (val == ULLONG_MAX) {
-                ret = -errno;
-                goto out;
-            }
-            if (end == pos) {
-                ret = -EINVAL;
-                goto out;
-            }
-            if (val > INT_MAX) {
-                ret = -ERANGE;
-                goto out;
-            }
+            if (val == ULLONG_MAX)
+                return -errno;
+            if (end == pos)
+                return -EINVAL;
+            if (val > INT_MAX)
+                return -ERANGE;
 
             bit_end = (int)val;
             pos = end;
@@ -123,20 +103,41 @@ int sysfs_parse_bitlist(const char *path, unsigned long *bits, int nbits)
             bit_end = bit_start;
         }
 
-        if (bit_end < bit_start) {
-            ret = EINVAL;
-            goto out;
-        }
-        if (bit_end >= nbits) {
-            ret = -ERANGE;
-            goto out;
-        }
+        if (bit_end < bit_start)
+            return -EINVAL;
+        if (bit_end >= nbits)
+            return -ERANGE;
 
         for (; bit_start <= bit_end; bit_start++)
             bitmap_set(bits, bit_start);
     }
 
-out:
+    return 0;
+}
+
+/**
+ * sysfs_parse_bitlist - parses a bitlist value from a sysfs file
+ * @path: the sysfs file path
+ * @bits: the bitmap to store the result
+ * @nbits: the number of bits in the bitmap
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int sysfs_parse_bitlist(const char *path, unsigned long *bits, int nbits)
+{
+    FILE *f;
+    char buf[BUFSIZ];
+    int ret;
+
+    f = fopen(path, "r");
+    if (!f)
+        return -EIO;
+
+    /* an empty file (e.g. no isolated cpus) is an empty bitlist */
+    if (!fgets(buf, sizeof(buf), f))
+        buf[0] = '\0';
+
+    ret = parse_bitlist(buf, bits, nbits);
     fclose(f);
     return ret;
 }
@@ -4,6 +4,12 @@
  * Based heavily on Magazines and Vmem: Extending the Slab Allocator to Many
  * CPUs and Arbitrary Resources. Jeff Bonwick and Johnathan Adams.
  *
+ * Magazines start at the size given to tcache_create() and double (up to
+ * TCACHE_MAX_MAG_SIZE) whenever threads keep contending on the depot, so a
+ * cache that churns hard exchanges magazines less often. Full magazines are
+ * kept in TCACHE_NR_DEPOTS lock-sharded depots; each per-thread handle is
+ * homed on one shard and only steals from the others when its own is empty.
+ *
  * TODO: Improve NUMA awareness.
  * TODO: Provide an interface to tear-down thread caches.
  * TODO: Remove dependence on libc malloc().
@@ -12,6 +18,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <base/stddef.h>
 #include <base/log.h>
@@ -21,29 +28,43 @@
 static DEFINE_SPINLOCK(tcache_lock);
 static LIST_HEAD(tcache_list);
 
-static struct tcache_hdr *tcache_alloc_mag(struct tcache *tc)
+/* magazine sizes are always the initial size doubled some number of times */
+static inline unsigned int tcache_mag_class(struct tcache *tc,
+                                            unsigned int size)
+{
+    return __builtin_ctz(size / tc->base_mag_size);
+}
+
+static inline unsigned int tcache_class_size(struct tcache *tc,
+                                             unsigned int cls)
+{
+    return tc->base_mag_size << cls;
+}
+
+static struct tcache_hdr *tcache_alloc_mag(struct tcache *tc, unsigned int nr)
 {
     void *items[TCACHE_MAX_MAG_SIZE];
     struct tcache_hdr *head, **pos;
     int err, i;
 
-    err = tc->ops->alloc(tc, tc->mag_size, items);
+    err = tc->ops->alloc(tc, nr, items);
     if (err)
         return NULL;
 
     head = (struct tcache_hdr *)items[0];
     pos = &head->next_item;
-    for (i = 1; i < tc->mag_size; i++) {
+    for (i = 1; i < nr; i++) {
         *pos = (struct tcache_hdr *)items[i];
         pos = &(*pos)->next_item;
     }
 
     *pos = NULL;
-    atomic64_inc(&tc->mags_allocated);
+    atomic64_fetch_and_add(&tc->items_allocated, nr);
     return head;
 }
 
-static void tcache_free_mag(struct tcache *tc, struct tcache_hdr *hdr)
+static void tcache_free_mag(struct tcache *tc, struct tcache_hdr *hdr,
+                            unsigned int size)
 {
     void *items[TCACHE_MAX_MAG_SIZE];
     int nr = 0;
@@ -53,15 +74,101 @@ static void tcache_free_mag(struct tcache *tc, struct tcache_hdr *hdr)
         hdr = hdr->next_item;
     } while (hdr);
 
-    assert(nr == tc->mag_size);
+    assert(nr == size);
     tc->ops->free(tc, nr, items);
-    atomic64_dec(&tc->mags_allocated);
+    atomic64_fetch_and_sub(&tc->items_allocated, nr);
+}
+
+/*
+ * Bonwick's adaptive magazine sizing: contention on the depot means threads
+ * are exchanging magazines too often, so make future magazines larger. Races
+ * between shards can only lose an increment, never overshoot the maximum.
+ */
+static void tcache_grow_mag_size(struct tcache *tc)
+{
+    unsigned int size = ACCESS_ONCE(tc->mag_size);
+
+    if (size * 2 <= TCACHE_MAX_MAG_SIZE)
+        ACCESS_ONCE(tc->mag_size) = size * 2;
+}
+
+static struct tcache_depot *tcache_depot_lock(struct tcache *tc,
+                                              unsigned int idx)
+{
+    struct tcache_depot *d = &tc->depots[idx];
+
+    if (likely(spin_try_lock(&d->lock)))
+        return d;
+
+    spin_lock(&d->lock);
+    if (++d->contended % TCACHE_CONTENTION_THRESH == 0)
+        tcache_grow_mag_size(tc);
+    return d;
+}
+
+static void tcache_depot_push(struct tcache_depot *d, struct tcache_hdr *hdr,
+                              unsigned int cls)
+{
+    assert_spin_lock_held(&d->lock);
+    hdr->next_mag = d->mags[cls];
+    d->mags[cls] = hdr;
+    d->nr_mags++;
+}
+
+/* pops the largest magazine available, storing its class in @cls */
+static struct tcache_hdr *tcache_depot_pop(struct tcache_depot *d,
+                                           unsigned int *cls)
+{
+    struct tcache_hdr *hdr;
+    int i;
+
+    assert_spin_lock_held(&d->lock);
+    if (!d->nr_mags)
+        return NULL;
+
+    for (i = TCACHE_NR_MAG_CLASSES - 1; i >= 0; i--) {
+        hdr = d->mags[i];
+        if (!hdr)
+            continue;
+        d->mags[i] = hdr->next_mag;
+        d->nr_mags--;
+        *cls = i;
+        return hdr;
+    }
+
+    return NULL;
+}
+
+/* takes a magazine from another shard without waiting on its lock */
+static struct tcache_hdr *tcache_depot_steal(struct tcache *tc,
+                                             unsigned int home,
+                                             unsigned int *cls)
+{
+    struct tcache_depot *d;
+    struct tcache_hdr *hdr;
+    int i;
+
+    for (i = 1; i < TCACHE_NR_DEPOTS; i++) {
+        d = &tc->depots[(home + i) % TCACHE_NR_DEPOTS];
+        if (!ACCESS_ONCE(d->nr_mags) || !spin_try_lock(&d->lock))
+            continue;
+        hdr = tcache_depot_pop(d, cls);
+        if (hdr)
+            d->steals++;
+        spin_unlock(&d->lock);
+        if (hdr)
+            return hdr;
+    }
+
+    return NULL;
 }
 
 /* The thread-local cache allocation slow path. */
 void *__tcache_alloc(struct tcache_perthread *ltc)
 {
     struct tcache *tc = ltc->tc;
+    struct tcache_depot *d;
+    unsigned int cls = 0, size;
     void *item;
 
     /* must be out of rounds */
@@ -71,23 +178,30 @@ void *__tcache_alloc(struct tcache_perthread *ltc)
     /* CASE 1: exchange empty loaded mag with full previous mag */
     if (ltc->previous) {
         ltc->loaded = ltc->previous;
+        ltc->capacity = ltc->prev_capacity;
         ltc->previous = NULL;
         goto alloc;
     }
 
-    /* CASE 2: grab a magazine from the shared pool */
-    spin_lock(&tc->lock);
-    ltc->loaded = tc->shared_mags;
-    if (tc->shared_mags)
-        tc->shared_mags = tc->shared_mags->next_mag;
-    spin_unlock(&tc->lock);
+    /* CASE 2: grab a magazine from the local depot shard, then the others */
+    d = tcache_depot_lock(tc, ltc->depot);
+    ltc->loaded = tcache_depot_pop(d, &cls);
     if (ltc->loaded)
+        d->hits++;
+    spin_unlock(&d->lock);
+    if (!ltc->loaded)
+        ltc->loaded = tcache_depot_steal(tc, ltc->depot, &cls);
+    if (ltc->loaded) {
+        ltc->capacity = tcache_class_size(tc, cls);
         goto alloc;
+    }
 
     /* CASE 3: allocate a new magazine */
-    ltc->loaded = tcache_alloc_mag(tc);
+    size = ACCESS_ONCE(tc->mag_size);
+    ltc->loaded = tcache_alloc_mag(tc, size);
     if (unlikely(!ltc->loaded))
         return NULL;
+    ltc->capacity = size;
 
 alloc:
     /* reload the magazine and allocate an item */
@@ -102,6 +216,7 @@ void __tcache_free(struct tcache_perthread *ltc, void *item)
 {
     struct tcache *tc = ltc->tc;
     struct tcache_hdr *hdr = (struct tcache_hdr *)item;
+    struct tcache_depot *d;
 
     /* magazine must be full */
     assert(ltc->rounds == ltc->capacity);
@@ -110,18 +225,21 @@ void __tcache_free(struct tcache_perthread *ltc, void *item)
     /* CASE 1: exchange empty previous mag with full loaded mag */
     if (!ltc->previous) {
         ltc->previous = ltc->loaded;
+        ltc->prev_capacity = ltc->capacity;
         goto free;
     }
 
-    /* CASE 2: return a magazine to the shared pool */
-    spin_lock(&tc->lock);
-    ltc->previous->next_mag = tc->shared_mags;
-    tc->shared_mags = ltc->previous;
-    spin_unlock(&tc->lock);
+    /* CASE 2: return a magazine to the local depot shard */
+    d = tcache_depot_lock(tc, ltc->depot);
+    tcache_depot_push(d, ltc->previous,
+                      tcache_mag_class(tc, ltc->prev_capacity));
+    spin_unlock(&d->lock);
     ltc->previous = ltc->loaded;
+    ltc->prev_capacity = ltc->capacity;
 
 free:
-    /* start a new magazine and free the item */
+    /* start a new magazine (possibly larger) and free the item */
+    ltc->capacity = ACCESS_ONCE(tc->mag_size);
     ltc->rounds = 1;
     ltc->loaded = hdr;
     hdr->next_item = NULL;
@@ -131,11 +249,14 @@ free:
  * tcache_create - creates a new thread-local cache
  * @name: a human-readable name to identify the cache
  * @ops: operations for allocating and freeing items that back the cache
- * @mag_size: the number of items in a magazine
+ * @mag_size: the initial number of items in a magazine
  * @item_size: the size of each item
  *
  * Returns a thread cache or NULL of out of memory.
  *
+ * Magazines grow (by doubling, up to TCACHE_MAX_MAG_SIZE) when threads
+ * contend on the depot, so the backing ops must tolerate larger batches.
+ *
  * After creating a thread-local cache, you'll want to attach one or more
  * thread-local handles using tcache_init_perthread().
  */
@@ -143,22 +264,27 @@ struct tcache *tcache_create(const char *name, const struct tcache_ops *ops,
                  unsigned int mag_size, size_t item_size)
 {
     struct tcache *tc;
+    int i;
 
     /* we assume the caller is aware of the tcache size limits */
     assert(item_size >= TCACHE_MIN_ITEM_SIZE);
-    assert(mag_size <= TCACHE_MAX_MAG_SIZE);
+    assert(mag_size > 0 && mag_size <= TCACHE_MAX_MAG_SIZE);
+    BUILD_ASSERT(1 << (TCACHE_NR_MAG_CLASSES - 1) >= TCACHE_MAX_MAG_SIZE);
 
-    tc = malloc(sizeof(*tc));
+    tc = aligned_alloc(CACHE_LINE_SIZE, sizeof(*tc));
     if (!tc)
         return NULL;
 
     tc->name = name;
     tc->ops = ops;
     tc->item_size = item_size;
-    atomic64_write(&tc->mags_allocated, 0);
+    atomic64_write(&tc->items_allocated, 0);
+    tc->base_mag_size = mag_size;
     tc->mag_size = mag_size;
-    spin_lock_init(&tc->lock);
-    tc->shared_mags = NULL;
+    atomic_write(&tc->next_depot, 0);
+    memset(tc->depots, 0, sizeof(tc->depots));
+    for (i = 0; i < TCACHE_NR_DEPOTS; i++)
+        spin_lock_init(&tc->depots[i].lock);
 
     spin_lock(&tcache_lock);
     list_add_tail(&tcache_list, &tc->link);
@@ -178,7 +304,12 @@ void tcache_init_perthread(struct tcache *tc, struct tcache_perthread *ltc)
     ltc->tc = tc;
     ltc->loaded = ltc->previous = NULL;
     ltc->rounds = 0;
-    ltc->capacity = tc->mag_size;
+    ltc->capacity = ACCESS_ONCE(tc->mag_size);
+    ltc->prev_capacity = 0;
+
+    /* spread threads (usually one per core) over the depot shards */
+    ltc->depot = (unsigned int)atomic_fetch_and_add(&tc->next_depot, 1) %
+                 TCACHE_NR_DEPOTS;
 }
 
 /**
@@ -187,17 +318,25 @@ void tcache_init_perthread(struct tcache *tc, struct tcache_perthread *ltc)
  */
 void tcache_reclaim(struct tcache *tc)
 {
+    struct tcache_hdr *mags[TCACHE_NR_MAG_CLASSES];
     struct tcache_hdr *hdr, *next;
-
-    spin_lock(&tc->lock);
-    hdr = tc->shared_mags;
-    tc->shared_mags = NULL;
-    spin_unlock(&tc->lock);
-
-    while (hdr) {
-        next = hdr->next_mag;
-        tcache_free_mag(tc, hdr);
-        hdr = next;
+    struct tcache_depot *d;
+    int i, cls;
+
+    for (i = 0; i < TCACHE_NR_DEPOTS; i++) {
+        d = &tc->depots[i];
+        spin_lock(&d->lock);
+        memcpy(mags, d->mags, sizeof(mags));
+        memset(d->mags, 0, sizeof(d->mags));
+        d->nr_mags = 0;
+        spin_unlock(&d->lock);
+
+        for (cls = 0; cls < TCACHE_NR_MAG_CLASSES; cls++) {
+            for (hdr = mags[cls]; hdr; hdr = next) {
+                next = hdr->next_mag;
+                tcache_free_mag(tc, hdr, tcache_class_size(tc, cls));
+            }
+        }
     }
 }
 
@@ -213,9 +352,22 @@ void tcache_print_usage(void)
 
     spin_lock(&tcache_lock);
     list_for_each(&tcache_list, tc, link) {
-        long mags = atomic64_read(&tc->mags_allocated);
-        size_t usage = tc->mag_size * tc->item_size * mags;
+        long items = atomic64_read(&tc->items_allocated);
+        size_t usage = tc->item_size * items;
+        unsigned long hits = 0, steals = 0, contended = 0;
+        int i;
+
+        /* the counters are read racily, which is fine for statistics */
+        for (i = 0; i < TCACHE_NR_DEPOTS; i++) {
+            hits += ACCESS_ONCE(tc->depots[i].hits);
+            steals += ACCESS_ONCE(tc->depots[i].steals);
+            contended += ACCESS_ONCE(tc->depots[i].contended);
+        }
+
         log_info("%8ld KB\t%s", usage / 1024, tc->name);
+        log_info("\tmag size %u (initial %u), depot hits %lu, steals %lu, "
+                 "contended %lu", ACCESS_ONCE(tc->mag_size),
+                 tc->base_mag_size, hits, steals, contended);
         total += usage;
     }
     spin_unlock(&tcache_lock);
@@ -0,0 +1,60 @@
+// arena.h - support for uthread-scoped temporary allocations
+
+#pragma once
+
+extern "C" {
+#include <runtime/arena.h>
+}
+
+#include <new>
+
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#define RT_HAVE_PMR 1
+#endif
+
+namespace rt {
+
+// Allocates temporary memory that lives until the calling uthread exits or
+// calls ArenaReset(). Throws std::bad_alloc on failure.
+static inline void *ArenaAlloc(size_t size,
+                               size_t align = UT_ARENA_ALIGN) {
+  void *p = ut_arena_alloc_aligned(size, align);
+  if (unlikely(!p)) throw std::bad_alloc();
+  return p;
+}
+
+// Frees every arena allocation made by the calling uthread.
+static inline void ArenaReset() {
+  ut_arena_reset();
+}
+
+#ifdef RT_HAVE_PMR
+
+// A memory resource backed by the calling uthread's arena. Deallocation is a
+// no-op; memory is reclaimed when the uthread exits or calls ArenaReset(). An
+// ArenaResource must only be used by the uthread that allocates through it.
+class ArenaResource : public std::pmr::memory_resource {
+ public:
+  ArenaResource() {}
+  ~ArenaResource() {}
+
+ private:
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    return ArenaAlloc(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override {}
+
+  bool do_is_equal(const std::pmr::memory_resource& other) const
+      noexcept override {
+    return this == &other;
+  }
+
+  ArenaResource(const ArenaResource&) = delete;
+  ArenaResource& operator=(const ArenaResource&) = delete;
+};
+
+#endif // RT_HAVE_PMR
+
+} // namespace rt
@@ -8,6 +8,13 @@ void ThreadTrampoline(void *arg) {
   (*static_cast<std::function<void()>*>(arg))();
 }
 
+// A helper to run (and then free) a closure posted to another kthread.
+void PostTrampoline(void *arg) {
+  auto *f = static_cast<std::function<void()>*>(arg);
+  (*f)();
+  delete f;
+}
+
 // A helper to jump from a C function to a C++ std::function. This variant
 // can wait for the thread to be joined.
 void ThreadTrampolineWithJoin(void *arg) {
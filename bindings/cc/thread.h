@@ -33,6 +33,7 @@ struct join_data {
 
 extern void ThreadTrampoline(void *arg);
 extern void ThreadTrampolineWithJoin(void *arg);
+extern void PostTrampoline(void *arg);
 
 } // namespace thread_internal
 
@@ -68,6 +69,17 @@ static inline thread_t* Spawn(std::function<void()>&& func,
   return th;
 }
 
+// Runs a closure on the kthread @kidx from its softirq handler. The closure
+// must not block. Returns false if @kidx is invalid or its ring is full.
+static inline bool Post(int kidx, std::function<void()>&& func) {
+  auto *f = new std::function<void()>(std::move(func));
+  if (unlikely(kthread_post(kidx, thread_internal::PostTrampoline, f))) {
+    delete f;
+    return false;
+  }
+  return true;
+}
+
 // Called from a running thread to exit.
 static inline void Exit(void) {
   thread_exit();
@@ -9,14 +9,13 @@
 
 static int commands_drain_queue(struct thread *t)
 {
-    int i;
-
-    for (i = 0; i < HWALLOCD_CMD_BURST_SIZE; i++) {
-        uint64_t cmd;
-        unsigned long payload;
+    struct lrpc_msg msgs[HWALLOCD_CMD_BURST_SIZE];
+    unsigned int i, n;
 
-        if (!lrpc_recv(&t->txq, &cmd, &payload))
-            break;
+    n = lrpc_recv_burst(&t->txq, msgs, HWALLOCD_CMD_BURST_SIZE);
+    for (i = 0; i < n; i++) {
+        uint64_t cmd = msgs[i].cmd;
+        unsigned long payload = msgs[i].payload;
 
         switch (cmd) {
         case TXCMD_PARKED_LAST:
@@ -1,5 +1,11 @@
 /*
  * control.c - the control-plane for the I/O kernel
+ *
+ * The control thread sleeps in epoll_wait() on the listening socket (edge
+ * triggered, drained with non-blocking accepts), on every client connection
+ * (for hangups), and on an eventfd the dataplane kicks when a client's state
+ * can be freed. Each event is handled in O(1), independent of the number of
+ * connected runtimes.
  */
 
 #include <fcntl.h>
@@ -7,7 +13,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -22,9 +30,16 @@
 
 #include "defs.h"
 
+#define CONTROL_MAX_EVENTS    64
+/* how often to retry accept() after running out of fds or memory */
+#define CONTROL_ACCEPT_RETRY_MS    100
+
 static pthread_attr_t controlattr;
 static int controlfd;
-static int clientfds[HWALLOCD_MAX_PROC];
+static int control_epfd;
+static int control_efd;
+/* accept() failed with the backlog non-empty, retry without an epoll event */
+static bool control_accept_stalled;
 static struct proc *clients[HWALLOCD_MAX_PROC];
 static int nr_clients;
 struct lrpc_params lrpc_control_to_data_params;
@@ -59,6 +74,16 @@ static struct proc *control_create_proc(mem_key_t key, size_t len, pid_t pid,
             hdr.thread_count != n_fds)
         goto fail_unmap;
 
+    if (hdr.sched_cfg.priority >= SCHED_PRIORITY_NR) {
+        log_err("unknown priority class %u", hdr.sched_cfg.priority);
+        goto fail_unmap;
+    }
+
+    if (hdr.sched_cfg.core_policy >= CORE_POLICY_NR) {
+        log_err("unknown core policy %u", hdr.sched_cfg.core_policy);
+        goto fail_unmap;
+    }
+
     if (hdr.sched_cfg.guaranteed_cores + nr_guaranteed > get_total_cores()) {
         log_err("guaranteed cores exceeds total core count");
         goto fail_unmap;
@@ -85,6 +110,7 @@ static struct proc *control_create_proc(mem_key_t key, size_t len, pid_t pid,
     p->region = reg;
     p->removed = false;
     p->sched_cfg = hdr.sched_cfg;
+    p->park_futex = !!(hdr.flags & CONTROL_FLAG_PARK_FUTEX);
     p->thread_count = hdr.thread_count;
     p->pending_timer = false;
     p->uniqid = libut_rdtsc();
@@ -109,7 +135,8 @@ static struct proc *control_create_proc(mem_key_t key, size_t len, pid_t pid,
         th->p = p;
         th->parked = true;
         th->waking = false;
-        th->reaffinitize = true;
+        th->repin_pending = false;
+        th->pinned_core = -1;
         th->at_idx = -1;
         th->ts_idx = -1;
 
@@ -212,8 +239,9 @@ static int control_recv_fds(int fd, int *fds, int n)
     return n_fds;
 }
 
-static void control_add_client(void)
+static int control_add_client(void)
 {
+    struct epoll_event ev;
     struct proc *p;
     struct ucred ucred;
     socklen_t len;
@@ -225,8 +253,13 @@ static void control_add_client(void)
 
     fd = accept(controlfd, NULL, NULL);
     if (fd == -1) {
-        log_err("control: accept() failed [%s]", strerror(errno));
-        return;
+        /* a client that gave up doesn't end the backlog */
+        if (errno == ECONNABORTED || errno == EINTR)
+            return 0;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            log_err_ratelimited("control: accept() failed [%s]",
+                                strerror(errno));
+        return -errno;
     }
 
     if (nr_clients >= HWALLOCD_MAX_PROC) {
@@ -265,6 +298,16 @@ static void control_add_client(void)
         log_err("control: failed to create process '%d'", ucred.pid);
         goto fail_close_fds;
     }
+    p->control_fd = fd;
+    p->control_idx = nr_clients;
+
+    /* the runtime never writes again, so any event means it went away */
+    ev.events = EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = p;
+    if (epoll_ctl(control_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        log_err("control: epoll_ctl() failed [%s]", strerror(errno));
+        goto fail_destroy_proc;
+    }
 
     if (!lrpc_send(&lrpc_control_to_data, DATAPLANE_ADD_CLIENT,
             (unsigned long) p)) {
@@ -272,118 +315,183 @@ static void control_add_client(void)
                 ucred.pid);
         goto fail_destroy_proc;
     }
+    dataplane_kick();
 
-    clients[nr_clients] = p;
-    clientfds[nr_clients++] = fd;
-    return;
+    clients[nr_clients++] = p;
+    return 0;
 
 fail_destroy_proc:
     control_destroy_proc(p);
+    close(fd);
+    return 0;
 fail_close_fds:
     for (i = 0; i < n_fds; i++)
         close(fds[i]);
 fail:
     close(fd);
+    return 0;
 }
 
-static void control_instruct_dataplane_to_remove_client(int fd)
+static void control_instruct_dataplane_to_remove_client(struct proc *p)
 {
-    int i;
-
-    for (i = 0; i < nr_clients; i++) {
-        if (clientfds[i] == fd)
-            break;
-    }
+    if (p->removed)
+        return;
 
-    if (i == nr_clients) {
+    /* stop watching the connection, it's closed once the dataplane is done */
+    if (epoll_ctl(control_epfd, EPOLL_CTL_DEL, p->control_fd, NULL) == -1)
         WARN();
-        return;
-    }
 
-    clients[i]->removed = true;
-    nr_guaranteed -= clients[i]->sched_cfg.guaranteed_cores;
+    p->removed = true;
+    nr_guaranteed -= p->sched_cfg.guaranteed_cores;
     if (!lrpc_send(&lrpc_control_to_data, DATAPLANE_REMOVE_CLIENT,
-            (unsigned long) clients[i])) {
+            (unsigned long) p)) {
         log_err("control: failed to inform dataplane of removed client");
+        return;
     }
+    dataplane_kick();
 }
 
 static void control_remove_client(struct proc *p)
 {
-    int i;
-
-    for (i = 0; i < nr_clients; i++) {
-        if (clients[i] == p)
-            break;
-    }
+    int i = p->control_idx;
 
-    if (i == nr_clients) {
+    if (i >= nr_clients || clients[i] != p) {
         WARN();
         return;
     }
 
+    close(p->control_fd);
     control_destroy_proc(p);
-    clients[i] = clients[nr_clients - 1];
 
-    close(clientfds[i]);
-    clientfds[i] = clientfds[nr_clients - 1];
-    nr_clients--;
+    clients[i] = clients[--nr_clients];
+    clients[i]->control_idx = i;
 }
 
-static void *control_loop(void *data)
+/**
+ * control_kick - wakes the control thread to reap removed clients
+ *
+ * Called by the dataplane after sending CONTROLPLANE_REMOVE_CLIENT.
+ */
+void control_kick(void)
+{
+    uint64_t val = 1;
+    ssize_t ret;
+
+    ret = write(control_efd, &val, sizeof(val));
+    WARN_ON_ONCE(ret != sizeof(val));
+}
+
+static void control_reap_clients(void)
 {
-    fd_set readset;
-    int maxfd, i, nrdy;
-    uint64_t cmd;
+    uint64_t cmd, val;
     unsigned long payload;
     struct proc *p;
 
-    while (1) {
-        maxfd = controlfd;
-        FD_ZERO(&readset);
-        FD_SET(controlfd, &readset);
+    /* reset the eventfd before draining, so no kick is lost */
+    if (read(control_efd, &val, sizeof(val)) != sizeof(val) &&
+        errno != EAGAIN)
+        WARN();
 
-        for (i = 0; i < nr_clients; i++) {
-            if (clients[i]->removed)
-                continue;
+    while (lrpc_recv(&lrpc_data_to_control, &cmd, &payload)) {
+        p = (struct proc *) payload;
+        assert(cmd == CONTROLPLANE_REMOVE_CLIENT);
 
-            FD_SET(clientfds[i], &readset);
-            maxfd = (clientfds[i] > maxfd) ? clientfds[i] : maxfd;
-        }
+        /* it is now safe to remove data structures for this client */
+        control_remove_client(p);
+    }
+}
 
-        nrdy = select(maxfd + 1, &readset, NULL, NULL, NULL);
+/*
+ * Accept every pending connection. The listener is edge triggered, so if
+ * accept() fails with the backlog still non-empty (e.g. out of fds), no new
+ * event arrives for the waiting clients. Retrying right away would just spin,
+ * so the control loop retries once a client is reaped or after a timeout.
+ */
+static void control_accept_clients(void)
+{
+    int ret;
+
+    do {
+        ret = control_add_client();
+    } while (ret == 0);
+
+    control_accept_stalled = ret != -EAGAIN && ret != -EWOULDBLOCK;
+}
+
+static void *control_loop(void *data)
+{
+    struct epoll_event events[CONTROL_MAX_EVENTS];
+    int i, nrdy, timeout;
+
+    while (1) {
+        timeout = control_accept_stalled ? CONTROL_ACCEPT_RETRY_MS : -1;
+        nrdy = epoll_wait(control_epfd, events, CONTROL_MAX_EVENTS, timeout);
         if (nrdy == -1) {
-            log_err("control: select() failed [%s]",
+            if (errno == EINTR)
+                continue;
+            log_err("control: epoll_wait() failed [%s]",
                 strerror(errno));
             BUG();
         }
 
-        for (i = 0; i <= maxfd && nrdy > 0; i++) {
-            if (!FD_ISSET(i, &readset))
-                continue;
-
-            if (i == controlfd) {
-                /* accept a new connection */
-                control_add_client();
+        for (i = 0; i < nrdy; i++) {
+            if (events[i].data.ptr == &controlfd) {
+                control_accept_clients();
+            } else if (events[i].data.ptr == &control_efd) {
+                control_reap_clients();
             } else {
                 /* close an existing connection */
-                control_instruct_dataplane_to_remove_client(i);
+                control_instruct_dataplane_to_remove_client(
+                    (struct proc *)events[i].data.ptr);
             }
-
-            nrdy--;
         }
 
-        while (lrpc_recv(&lrpc_data_to_control, &cmd, &payload)) {
-            p = (struct proc *) payload;
-            assert(cmd == CONTROLPLANE_REMOVE_CLIENT);
-
-            /* it is now safe to remove data structures for this client */
-            control_remove_client(p);
-        }
+        /* reaped clients may have freed fds, or the retry timeout expired */
+        if (control_accept_stalled)
+            control_accept_clients();
     }
     return NULL;
 }
 
+/*
+ * Create the epoll instance watching the listening socket and the dataplane.
+ */
+static int control_init_epoll(void)
+{
+    struct epoll_event ev;
+
+    control_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (control_epfd == -1) {
+        log_err("control: epoll_create1() failed [%s]", strerror(errno));
+        return -errno;
+    }
+
+    control_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (control_efd == -1) {
+        log_err("control: eventfd() failed [%s]", strerror(errno));
+        goto fail;
+    }
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &controlfd;
+    if (epoll_ctl(control_epfd, EPOLL_CTL_ADD, controlfd, &ev) == -1)
+        goto fail_ctl;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &control_efd;
+    if (epoll_ctl(control_epfd, EPOLL_CTL_ADD, control_efd, &ev) == -1)
+        goto fail_ctl;
+
+    return 0;
+
+fail_ctl:
+    log_err("control: epoll_ctl() failed [%s]", strerror(errno));
+    close(control_efd);
+fail:
+    close(control_epfd);
+    return -errno;
+}
+
 /*
  * Initialize channels for communicating with the I/O kernel dataplane.
  */
@@ -447,16 +555,25 @@ fail:
 int control_init(void)
 {
     struct sockaddr_un addr;
+    struct rlimit rl;
     pthread_t tid;
     int sfd, ret;
 
     BUILD_ASSERT(strlen(CONTROL_SOCK_PATH) <= sizeof(addr.sun_path) - 1);
 
+    /* each runtime holds a connection and an eventfd per kthread open */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+            log_warn("control: couldn't raise the fd limit [%s]",
+                     strerror(errno));
+    }
+
     memset(&addr, 0x0, sizeof(struct sockaddr_un));
     addr.sun_family = AF_UNIX;
     strncpy(addr.sun_path, CONTROL_SOCK_PATH, sizeof(addr.sun_path) - 1);
  
-    sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (sfd == -1) {
         log_err("control: socket() failed [%s]", strerror(errno));
         return -errno;
@@ -469,13 +586,19 @@ int control_init(void)
         return -errno;
     }
 
-    if (listen(sfd, 100) == -1) {
+    if (listen(sfd, SOMAXCONN) == -1) {
         log_err("control: listen() failed[%s]", strerror(errno));
         close(sfd);
         return -errno;
     }
     controlfd = sfd;
 
+    ret = control_init_epoll();
+    if (ret < 0) {
+        close(sfd);
+        return ret;
+    }
+
     ret = control_init_dataplane_comm();
     if (ret < 0) {
         log_err("control: cannot initialize communication with dataplane");
@@ -2,14 +2,21 @@
  * cores.c - manages assignments of cores to runtimes, the iokernel, and linux
  */
 
+#include <limits.h>
+#include <linux/futex.h>
+#include <numaif.h>
 #include <sched.h>
 #include <signal.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
 #include <base/bitmap.h>
 #include <base/cpu.h>
 #include <base/log.h>
+#include <base/sysfs.h>
+#include <base/thread.h>
 #include <hwalloc/queue.h>
 
 #include "defs.h"
@@ -20,10 +27,15 @@ static unsigned int nr_avail_cores;
 static unsigned int total_cores;
 static DEFINE_BITMAP(online_cores, NCPU);
 
+/* the managed cores on each package */
+static unsigned long pkg_cores[NNUMA][BITMAP_LONG_SIZE(NCPU)];
+
 DEFINE_BITMAP(avail_cores, NCPU);
 struct core_assignments core_assign;
 unsigned int nrts = 0;
 struct thread *ts[NCPU];
+/* the CORE_POLICY_DELAY target for runtimes that don't specify one */
+unsigned int cores_default_delay_us = CORES_DEFAULT_DELAY_US;
 
 /* maps each cpu number to the number of its hyperthread buddy */
 static int cpu_siblings[NCPU];
@@ -56,10 +68,30 @@ struct core {
     struct thread    *current;
     struct thread    *prev;
     struct thread    *next; /* if non-NULL, thread that preempted this core */
+    uint64_t         preempt_us; /* when @next asked for the core */
 };
 
 static struct core core_history[NCPU];
 
+/* cores whose preemption may still need a signal */
+static DEFINE_BITMAP(preempting_cores, NCPU);
+static unsigned int nr_preempting_cores;
+
+/* kthreads woken on a core other than the one they are pinned to */
+static struct thread *repin_queue[NCPU];
+static unsigned int nr_repins_queued;
+
+/* affinity statistics, reported by cores_log_stats() */
+static struct {
+    uint64_t    wakes;      /* kthreads woken on a core */
+    uint64_t    repins;     /* sched_setaffinity() calls made */
+    uint64_t    coalesced;  /* queued repins that became unnecessary */
+    uint64_t    spills;     /* cores granted off a proc's package */
+    uint64_t    preempts;   /* cores preempted from a running kthread */
+    uint64_t    signals;    /* preemptions that fell back to a signal */
+    uint64_t    preempt_us; /* total time until preempted kthreads parked */
+} cores_stats;
+
 /**
  * core_reserve - record that core is now in use by thread
  * @core: the core to reserve
@@ -117,8 +149,77 @@ static inline bool core_available(unsigned int core)
     return bitmap_test(avail_cores, core);
 }
 
-/* a list of procs that currently require more cores */
-static LIST_HEAD(overloaded_procs);
+/**
+ * core_pkg - returns the package (socket) a core belongs to
+ */
+static inline int core_pkg(unsigned int core)
+{
+    return cpu_info_tbl[core].package;
+}
+
+/**
+ * proc_pkg - returns the package a proc's next core should come from: where
+ * its kthreads run, or else where its shared memory lives
+ */
+static inline int proc_pkg(struct proc *p)
+{
+    if (p->active_thread_count > 0)
+        return core_pkg(p->active_threads[0]->core);
+    return p->home_pkg;
+}
+
+/**
+ * find_avail_core_near - returns an available core sharing a cache with one of
+ * @p's running kthreads, or -1 if none
+ * @p: the process
+ * @llc: match the last level cache instead of the L2
+ */
+static int find_avail_core_near(struct proc *p, bool llc)
+{
+    unsigned long *mask;
+    int i, core;
+
+    for (i = 0; i < p->active_thread_count; i++) {
+        core = p->active_threads[i]->core;
+        mask = llc ? cpu_info_tbl[core].llc_siblings_mask :
+                     cpu_info_tbl[core].l2_siblings_mask;
+        bitmap_for_each_set(mask, cpu_count, core) {
+            if (core_available(core))
+                return core;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * pkg_find_avail_core - returns an available core on @pkg, or -1 if none
+ */
+static int pkg_find_avail_core(int pkg)
+{
+    int core;
+
+    bitmap_for_each_set(pkg_cores[pkg], cpu_count, core) {
+        if (core_available(core))
+            return core;
+    }
+
+    return -1;
+}
+
+/**
+ * proc_prio - returns the priority class of a process
+ * @p: the process
+ *
+ * Lower values are more important (SCHED_PRIORITY_SYSTEM is 0).
+ */
+static inline unsigned int proc_prio(struct proc *p)
+{
+    return p->sched_cfg.priority;
+}
+
+/* lists of procs that currently require more cores, per priority class */
+static struct list_head overloaded_procs[SCHED_PRIORITY_NR];
 
 /**
  * proc_set_overloaded - marks a process as overloaded
@@ -129,7 +230,7 @@ void proc_set_overloaded(struct proc *p)
     if (p->overloaded)
         return;
 
-    list_add(&overloaded_procs, &p->overloaded_link);
+    list_add(&overloaded_procs[proc_prio(p)], &p->overloaded_link);
     p->overloaded = true;
 }
 
@@ -142,7 +243,7 @@ static inline void proc_clear_overloaded(struct proc *p)
     if (!p->overloaded)
         return;
 
-    list_del_from(&overloaded_procs, &p->overloaded_link);
+    list_del_from(&overloaded_procs[proc_prio(p)], &p->overloaded_link);
     p->overloaded = false;
 }
 
@@ -161,19 +262,37 @@ static inline bool proc_is_overloaded(struct proc *p)
  */
 static inline bool no_overloaded_procs()
 {
-    return list_empty(&overloaded_procs);
+    int i;
+
+    for (i = 0; i < SCHED_PRIORITY_NR; i++) {
+        if (!list_empty(&overloaded_procs[i]))
+            return false;
+    }
+
+    return true;
 }
 
 /**
- * get_overloaded_proc - returns an overloaded proc or NULL if none exists
+ * get_overloaded_proc - returns an overloaded proc of the most important
+ * class or NULL if none exists
  */
 static inline struct proc *get_overloaded_proc()
 {
-    return list_top(&overloaded_procs, struct proc, overloaded_link);
+    struct proc *p;
+    int i;
+
+    for (i = 0; i < SCHED_PRIORITY_NR; i++) {
+        p = list_top(&overloaded_procs[i], struct proc, overloaded_link);
+        if (p)
+            return p;
+    }
+
+    return NULL;
 }
 
-/* a list of procs that are using more cores than they have reserved */
-static LIST_HEAD(bursting_procs);
+/* lists of procs that are using more cores than they have reserved, per
+ * priority class */
+static struct list_head bursting_procs[SCHED_PRIORITY_NR];
 
 /**
  * proc_set_bursting - marks a process as bursting
@@ -184,7 +303,7 @@ static inline void proc_set_bursting(struct proc *p)
     if (p->bursting)
         return;
 
-    list_add(&bursting_procs, &p->bursting_link);
+    list_add(&bursting_procs[proc_prio(p)], &p->bursting_link);
     p->bursting = true;
 }
 
@@ -197,7 +316,7 @@ static inline void proc_clear_bursting(struct proc *p)
     if (!p->bursting)
         return;
 
-    list_del_from(&bursting_procs, &p->bursting_link);
+    list_del_from(&bursting_procs[proc_prio(p)], &p->bursting_link);
     p->bursting = false;
 }
 
@@ -211,11 +330,40 @@ static inline bool proc_is_bursting(struct proc *p)
 }
 
 /**
- * get_bursting_proc - returns a bursting proc or NULL if none exists
+ * proc_can_preempt - returns true if @p may take a core from @victim
+ * @p: the process that wants a core
+ * @victim: the process currently running on the core
+ *
+ * Only cores past a victim's guarantee are taken. A process below its own
+ * guarantee may take them from anyone; otherwise only from a less important
+ * class.
  */
-static inline struct proc *get_bursting_proc()
+static inline bool proc_can_preempt(struct proc *p, struct proc *victim)
 {
-    return list_top(&bursting_procs, struct proc, bursting_link);
+    if (victim == p || !proc_is_bursting(victim))
+        return false;
+
+    return p->active_thread_count < p->sched_cfg.guaranteed_cores ||
+           proc_prio(victim) > proc_prio(p);
+}
+
+/**
+ * get_victim_prio - returns the least important class @p may preempt, or -1
+ * @p: the process that wants a core
+ */
+static int get_victim_prio(struct proc *p)
+{
+    struct proc *victim;
+    int i;
+
+    for (i = SCHED_PRIORITY_NR - 1; i >= 0; i--) {
+        list_for_each(&bursting_procs[i], victim, bursting_link) {
+            if (proc_can_preempt(p, victim))
+                return i;
+        }
+    }
+
+    return -1;
 }
 
 /**
@@ -231,8 +379,6 @@ static inline void thread_reserve(struct thread *th, unsigned int core)
     assert(th->parked == true);
 
     bitmap_clear(p->available_threads, kthread);
-    if (unlikely(core != th->core))
-        th->reaffinitize = true;
     th->core = core;
     p->active_threads[p->active_thread_count] = th;
     th->at_idx = p->active_thread_count++;
@@ -341,6 +487,12 @@ static struct thread *pick_thread_for_proc(struct proc *p, int core)
     if (lastth && lastth->p == p && lastth->parked)
         return lastth;
 
+    /* try any kthread still pinned to this core, avoiding a repin */
+    list_for_each(&p->idle_threads, lastth, idle_link) {
+        if (lastth->pinned_core == core)
+            return lastth;
+    }
+
     /* return the least recently parked kthread */
     return list_tail(&p->idle_threads, struct thread, idle_link);
 }
@@ -349,12 +501,13 @@ static struct thread *pick_thread_for_proc(struct proc *p, int core)
  * pick_core_for_proc - choose a core to allocate to proc p.
  * @p: the process to allocate a core to
  *
- * Returns an available core if one exists, or else a core to be preempted.
+ * Returns an available core if one exists, or else a core to be preempted, or
+ * -1 if neither exists.
  */
 static int pick_core_for_proc(struct proc *p)
 {
     int buddy_core, core;
-    int i;
+    int i, pkg = proc_pkg(p);
     struct thread *t;
     struct proc *buddy_proc, *core_proc;
 
@@ -371,7 +524,8 @@ static int pick_core_for_proc(struct proc *p)
             continue;
 
         buddy_proc = core_history[buddy_core].current->p;
-        if (buddy_proc != p && proc_is_bursting(buddy_proc))
+        if (proc_can_preempt(p, buddy_proc) &&
+            proc_prio(buddy_proc) == get_victim_prio(p))
             return buddy_core;
     }
 #endif
@@ -379,35 +533,65 @@ static int pick_core_for_proc(struct proc *p)
     /* try the core that we most recently ran on */
     t = list_top(&p->idle_threads, struct thread, idle_link);
     core = t->core;
-    if (core_available(core))
+    if (core_available(core) && core_pkg(core) == pkg)
         return core;
 
     /* core is busy, should we preempt it? */
     if (nr_avail_cores == 0 && core_history[core].next == NULL) {
         core_proc = core_history[core].current->p;
-        if (core_proc != p && proc_is_bursting(core_proc))
+        if (proc_can_preempt(p, core_proc) &&
+            proc_prio(core_proc) == get_victim_prio(p))
             return core;
     }
 
-    /* pick the lowest available core */
+    /* try an idle core that one of our kthreads is still pinned to */
+    list_for_each(&p->idle_threads, t, idle_link) {
+        if (t->pinned_core >= 0 && core_available(t->pinned_core) &&
+            core_pkg(t->pinned_core) == pkg)
+            return t->pinned_core;
+    }
+
+    /* keep our kthreads in as few L2 clusters and L3 slices as possible,
+     * so work stealing in the runtime stays cache-local */
+    core = find_avail_core_near(p, false);
+    if (core >= 0)
+        return core;
+    core = find_avail_core_near(p, true);
+    if (core >= 0)
+        return core;
+
+    /* pick the lowest available core on our package */
+    core = pkg_find_avail_core(pkg);
+    if (core >= 0)
+        return core;
+
+    /* the package is full, spill to a remote one before preempting */
     core = bitmap_find_next_set(avail_cores, cpu_count, 0);
-    if (core != cpu_count)
+    if (core != cpu_count) {
+        cores_stats.spills++;
         return core;
+    }
 
-    /* no cores available, take from the first bursting proc */
+    /* no cores available, take from the least important bursting proc */
+    core = -1;
     for (i = 0; i < cpu_count; i++) {
         if (!core_history[i].current)
             continue;
-        if (!proc_is_bursting(core_history[i].current->p))
-            continue;
         if (core_history[i].next != NULL)
             continue;
-        return i;
+        core_proc = core_history[i].current->p;
+        if (!proc_can_preempt(p, core_proc))
+            continue;
+        if (core == -1 ||
+            proc_prio(core_proc) > proc_prio(core_history[core].current->p))
+            core = i;
+    }
+    if (core == -1) {
+        /* every preemptible core already has a preemption in flight */
+        log_debug("pick_core_for_proc: no available cores");
     }
 
-    log_err("pick_core_for_proc: no available cores!");
-    BUG();
-    return 0;
+    return core;
 }
 
 /**
@@ -420,25 +604,30 @@ static int pick_core_for_proc(struct proc *p)
 static struct thread *pick_thread_for_core(int core)
 {
     struct thread *th_next;
-    int buddy_core;
-    struct proc *p;
+    int buddy_core, sibling;
+    struct proc *p, *top;
 
     /* if this core was preempted, grant it to the thread that is waiting for
      * it */
     th_next = core_history[core].next;
     if (th_next != NULL && !th_next->p->removed) {
         core_history[core].current->p->inflight_preempts--;
+        cores_stats.preempt_us += microtime() - core_history[core].preempt_us;
         return th_next;
     }
 
     /* try to find an overloaded proc to grant this core to */
-    if (no_overloaded_procs())
+    top = get_overloaded_proc();
+    if (!top)
         return NULL;
 
+    /* locality only decides among the most important overloaded class */
+
     /* try to allocate to the process that used this core most recently */
     if (core_history[core].current) {
         p = core_history[core].current->p;
-        if (!p->removed && proc_is_overloaded(p))
+        if (!p->removed && proc_is_overloaded(p) &&
+            proc_prio(p) == proc_prio(top))
             goto chose_proc;
     }
 
@@ -447,25 +636,164 @@ static struct thread *pick_thread_for_core(int core)
     buddy_core = cpu_to_sibling_cpu(core);
     if (core_history[buddy_core].current) {
         p = core_history[buddy_core].current->p;
-        if (!p->removed && proc_is_overloaded(p))
+        if (!p->removed && proc_is_overloaded(p) &&
+            proc_prio(p) == proc_prio(top))
             goto chose_proc;
     }
 #endif
 
+    /* try to allocate to a process running in the same L2 cluster */
+    bitmap_for_each_set(cpu_info_tbl[core].l2_siblings_mask, cpu_count,
+                        sibling) {
+        if (sibling == core || !core_history[sibling].current ||
+            core_available(sibling))
+            continue;
+        p = core_history[sibling].current->p;
+        if (!p->removed && proc_is_overloaded(p) &&
+            proc_prio(p) == proc_prio(top))
+            goto chose_proc;
+    }
+
     /* try to allocate to the process that used this core previously */
     if (core_history[core].prev) {
         p = core_history[core].prev->p;
-        if (!p->removed && proc_is_overloaded(p))
+        if (!p->removed && proc_is_overloaded(p) &&
+            proc_prio(p) == proc_prio(top))
             goto chose_proc;
     }
 
-    /* choose any overloaded proc */
-    p = get_overloaded_proc();
+    /* choose any overloaded proc of the most important class */
+    p = top;
 
 chose_proc:
     return pick_thread_for_proc(p, core);
 }
 
+/**
+ * thread_wake - unblock a parked kthread, telling it which core it is on
+ * @th: the thread to wake
+ */
+static void thread_wake(struct thread *th)
+{
+    uint64_t val = th->core + 1;
+    ssize_t s;
+
+    if (th->p->park_futex) {
+        /* no syscall needed if the kthread is still spinning */
+        if (atomic_xchg(&th->q_ptrs->park_word, val) == PARK_WORD_SLEEPING)
+            syscall(SYS_futex, &th->q_ptrs->park_word.cnt, FUTEX_WAKE, 1,
+                    NULL, NULL, 0);
+        return;
+    }
+
+    s = write(th->park_efd, &val, sizeof(val));
+    BUG_ON(s != sizeof(uint64_t));
+}
+
+/**
+ * cores_repin - pins a kthread to its current core now
+ * @th: the thread to pin
+ */
+static void cores_repin(struct thread *th)
+{
+    int ret;
+
+    ret = cores_pin_thread(th->tid, th->core);
+    cores_stats.repins++;
+    if (unlikely(ret < 0)) {
+        log_err("cores: failed to pin tid %d to core %d",
+            th->tid, th->core);
+        /* continue running but performance is unpredictable */
+        th->pinned_core = -1;
+    } else {
+        th->pinned_core = th->core;
+    }
+}
+
+/**
+ * cores_flush_repins - applies the affinity changes queued since the last call
+ *
+ * A kthread that parked or moved back to its pinned core in the meantime
+ * doesn't need a sched_setaffinity() call, so batching repins per dataplane
+ * iteration coalesces flip-flopping assignments.
+ */
+void cores_flush_repins(void)
+{
+    struct thread *th;
+    unsigned int i;
+
+    for (i = 0; i < nr_repins_queued; i++) {
+        th = repin_queue[i];
+        th->repin_pending = false;
+
+        if (th->parked || th->pinned_core == th->core || th->p->kill) {
+            cores_stats.coalesced++;
+            proc_put(th->p);
+            continue;
+        }
+
+        cores_repin(th);
+        proc_put(th->p);
+    }
+
+    nr_repins_queued = 0;
+}
+
+/**
+ * cores_queue_repin - schedules a kthread to be pinned to its current core
+ * @th: the thread to pin
+ */
+static void cores_queue_repin(struct thread *th)
+{
+    if (th->repin_pending)
+        return;
+
+    if (unlikely(nr_repins_queued == ARRAY_SIZE(repin_queue)))
+        cores_flush_repins();
+
+    /* keep the proc alive until the flush */
+    proc_get(th->p);
+    th->repin_pending = true;
+    repin_queue[nr_repins_queued++] = th;
+}
+
+/**
+ * cores_log_stats - logs and resets how often kthreads had to be repinned
+ */
+void cores_log_stats(void)
+{
+    if (!cores_stats.wakes)
+        return;
+
+    log_info("cores: %lu wakes, %lu repins (%.1f%%), %lu repins coalesced, "
+             "%lu remote spills", cores_stats.wakes, cores_stats.repins,
+             100.0 * cores_stats.repins / cores_stats.wakes,
+             cores_stats.coalesced, cores_stats.spills);
+    if (cores_stats.preempts) {
+        log_info("cores: %lu preemptions, %lu signalled, %.1f us to yield",
+                 cores_stats.preempts, cores_stats.signals,
+                 (double)cores_stats.preempt_us / cores_stats.preempts);
+    }
+    memset(&cores_stats, 0, sizeof(cores_stats));
+}
+
+/**
+ * cores_can_defer_repin - returns true if a kthread may briefly keep running
+ * on its pinned core after waking, i.e. its own proc is using that core
+ * @th: the thread to check
+ *
+ * An idle core doesn't qualify, it could be granted to another proc before
+ * cores_flush_repins() runs.
+ */
+static bool cores_can_defer_repin(struct thread *th)
+{
+    int core = th->pinned_core;
+
+    if (core < 0 || core_available(core))
+        return false;
+    return core_history[core].current && core_history[core].current->p == th->p;
+}
+
 /**
  * wake_kthread_on_core - wake the kthread on the specified core.
  * @p: the process to choose a kthread from
@@ -473,10 +801,6 @@ chose_proc:
  */
 static void wake_kthread_on_core(struct thread *th, int core)
 {
-    int ret;
-    ssize_t s;
-    uint64_t val;
-
     BUG_ON(!core_available(core)); /* core should be idle now */
 
     /* mark core and kthread as reserved */
@@ -484,23 +808,24 @@ static void wake_kthread_on_core(struct thread *th, int core)
     if (th->parked)
         thread_reserve(th, core);
 
-    /* assign the kthread to its core */
-    if (th->reaffinitize) {
-        ret = cores_pin_thread(th->tid, th->core);
-        if (unlikely(ret < 0)) {
-            log_err("cores: failed to pin tid %d to core %d",
-                th->tid, th->core);
-            /* continue running but performance is unpredictable */
-        } else {
-            th->reaffinitize = false;
-        }
-    }
+    /* drop any preemption request left over from its last core */
+    ACCESS_ONCE(th->q_ptrs->preempt_flag) = 0;
 
+    /*
+     * Its old core may belong to another proc by now, or be granted to one
+     * before the flush, and the kthread would run on top of it, so repin
+     * before waking unless its own proc holds that core.
+     */
+    if (th->pinned_core != th->core && !cores_can_defer_repin(th))
+        cores_repin(th);
 
-    val = th->core + 1;
     /* wake up the kthread */
-    s = write(th->park_efd, &val, sizeof(val));
-    BUG_ON(s != sizeof(uint64_t));
+    thread_wake(th);
+    cores_stats.wakes++;
+
+    /* assign the kthread to its core, off the wakeup's critical path */
+    if (th->pinned_core != th->core)
+        cores_queue_repin(th);
 }
 
 /**
@@ -515,8 +840,6 @@ bool cores_park_kthread(struct thread *th, bool force)
     struct proc *p = th->p;
     unsigned int core = th->core;
     unsigned int kthread = th - p->threads;
-    ssize_t s;
-    uint64_t val;
     struct thread *th_new;
 
     assert(kthread < NCPU);
@@ -530,9 +853,7 @@ bool cores_park_kthread(struct thread *th, bool force)
         lrpc_poll_send_tail(&th->rxq);
         if (unlikely(lrpc_get_cached_length(&th->rxq) > 0)) {
             /* the runtime parked while packets were in flight */
-            val = th->core + 1;
-            s = write(th->park_efd, &val, sizeof(val));
-            BUG_ON(s != sizeof(uint64_t));
+            thread_wake(th);
             return false;
         }
     }
@@ -580,6 +901,11 @@ struct thread *cores_add_core(struct proc *p)
 
     /* pick a core to add and a thread to run on it */
     core = pick_core_for_proc(p);
+    if (core < 0) {
+        /* wait for a core to be released */
+        proc_set_overloaded(p);
+        return NULL;
+    }
     th = pick_thread_for_proc(p, core);
     if (!th) {
         log_err("cores: proc already has max allowed kthreads (%d)",
@@ -601,14 +927,258 @@ struct thread *cores_add_core(struct proc *p)
     th_current->p->inflight_preempts++;
     BUG_ON(core_history[core].next);
     core_history[core].next = th;
-    if (unlikely(syscall(SYS_tgkill, th_current->p->pid,
-             th_current->tid, SIGUSR1) < 0)) {
-        WARN();
+    core_history[core].preempt_us = microtime();
+    cores_stats.preempts++;
+
+    /* ask the kthread to yield at its next preemption point, and only
+     * signal it if it doesn't in time (see cores_check_preempts()); the
+     * runtime may have a time slice yield pending in the same word */
+    __atomic_or_fetch(&th_current->q_ptrs->preempt_flag, PREEMPT_FLAG_CORE,
+                      __ATOMIC_RELAXED);
+    if (!bitmap_test(preempting_cores, core)) {
+        bitmap_set(preempting_cores, core);
+        nr_preempting_cores++;
     }
 
     return th;
 }
 
+/**
+ * cores_check_preempts - signals kthreads that ignored the preempt flag
+ * @now_us: the current time
+ *
+ * A kthread only sees the flag when it enables preemption or schedules, so a
+ * thread stuck in a long computation still needs a SIGUSR1.
+ */
+void cores_check_preempts(uint64_t now_us)
+{
+    struct thread *th;
+    int core;
+
+    if (likely(!nr_preempting_cores))
+        return;
+
+    bitmap_for_each_set(preempting_cores, cpu_count, core) {
+        /* already yielded, or the preempting proc went away */
+        if (!core_history[core].next)
+            goto done;
+
+        if (now_us - core_history[core].preempt_us < CORES_PREEMPT_TIMEOUT_US)
+            continue;
+
+        th = core_history[core].current;
+        cores_stats.signals++;
+        if (unlikely(syscall(SYS_tgkill, th->p->pid, th->tid, SIGUSR1) < 0))
+            WARN();
+
+done:
+        bitmap_clear(preempting_cores, core);
+        nr_preempting_cores--;
+    }
+}
+
+/*
+ * Core allocation policies
+ *
+ * Each policy decides whether a proc would benefit from another core. It is
+ * called for every client each CORES_ADJUST_INTERVAL_US and selected per proc
+ * through sched_spec.core_policy.
+ */
+
+struct core_policy {
+    const char  *name;
+    bool        (*congested)(struct proc *p, uint64_t now);
+};
+
+/*
+ * The Shenango heuristic: congested if a runqueue or RX queue tail didn't
+ * catch up with the head observed at the previous check.
+ */
+static bool policy_congestion_check(struct proc *p, uint64_t now)
+{
+    struct thread *th;
+    uint32_t rq_tail, rxq_tail, last_rq_head, last_rxq_head;
+    bool congested = false;
+    int i;
+
+    for (i = 0; i < p->active_thread_count; i++) {
+        th = p->active_threads[i];
+
+        /* update the queue positions */
+        rq_tail = load_acquire(&th->q_ptrs->rq_tail);
+        rxq_tail = lrpc_poll_send_tail(&th->rxq);
+        last_rq_head = th->last_rq_head;
+        last_rxq_head = th->last_rxq_head;
+        th->last_rq_head = ACCESS_ONCE(th->q_ptrs->rq_head);
+        th->last_rxq_head = ACCESS_ONCE(th->rxq.send_head);
+
+        /* if one prior queue was congested, no need to find more */
+        if (congested)
+            continue;
+
+        /* if the thread just woke up, give it a pass this round */
+        if (th->waking) {
+            th->waking = false;
+            continue;
+        }
+
+        /* check if the runqueue is congested */
+        if (wraps_lt(rq_tail, last_rq_head)) {
+            congested = true;
+            continue;
+        }
+
+        /* check if the RX queue is congested */
+        if (wraps_lt(rxq_tail, last_rxq_head)) {
+            congested = true;
+            continue;
+        }
+
+    }
+
+    return congested;
+}
+
+/*
+ * Returns how long the oldest runnable thread has waited, as published by the
+ * runtime in its q_ptrs.
+ */
+static uint64_t rq_delay_us(struct thread *th, uint64_t now_tsc)
+{
+    uint64_t oldest_tsc;
+
+    if (ACCESS_ONCE(th->q_ptrs->rq_head) ==
+        load_acquire(&th->q_ptrs->rq_tail))
+        return 0;
+
+    oldest_tsc = ACCESS_ONCE(th->q_ptrs->oldest_tsc);
+    if (!oldest_tsc || wraps_lt(now_tsc, oldest_tsc))
+        return 0;
+
+    return (now_tsc - oldest_tsc) / cycles_per_us;
+}
+
+/**
+ * cores_rxq_delay_us - estimates how long the oldest RX queue message waited
+ * @head: the queue's producer index
+ * @tail: the queue's consumer index
+ * @since_head: the producer index when the estimate started
+ * @since_us: the time when the estimate started, 0 if not started
+ * @now: the current time
+ *
+ * Returns the time since the queue was seen non-empty without having drained
+ * the messages it held at that moment. This is a lower bound, precise to one
+ * interval.
+ */
+uint64_t cores_rxq_delay_us(uint32_t head, uint32_t tail,
+                            uint32_t *since_head, uint64_t *since_us,
+                            uint64_t now)
+{
+    if (head == tail) {
+        *since_us = 0;
+        return 0;
+    }
+
+    /* start over once the messages seen at the snapshot are consumed */
+    if (!*since_us || !wraps_lt(tail, *since_head)) {
+        *since_head = head;
+        *since_us = now;
+    }
+
+    return now - *since_us;
+}
+
+/*
+ * Congested if any queue's delay exceeds congestion_latency_us while under
+ * the guaranteed cores, or scaleout_latency_us while bursting past them.
+ */
+static bool policy_delay_check(struct proc *p, uint64_t now)
+{
+    struct thread *th;
+    uint64_t delay, max_delay = 0, target, now_tsc = libut_rdtsc();
+    int i;
+
+    for (i = 0; i < p->active_thread_count; i++) {
+        th = p->active_threads[i];
+
+        delay = rq_delay_us(th, now_tsc);
+        max_delay = libut_max(max_delay, delay);
+
+        delay = cores_rxq_delay_us(ACCESS_ONCE(th->rxq.send_head),
+                                   lrpc_poll_send_tail(&th->rxq),
+                                   &th->delay_rxq_head,
+                                   &th->delay_rxq_since_us, now);
+        max_delay = libut_max(max_delay, delay);
+    }
+
+    if (p->active_thread_count < p->sched_cfg.guaranteed_cores)
+        target = p->sched_cfg.congestion_latency_us;
+    else
+        target = p->sched_cfg.scaleout_latency_us;
+    if (!target)
+        target = cores_default_delay_us;
+
+    return max_delay >= target;
+}
+
+/*
+ * Congested if, on average, more than CORES_UTIL_THRESH of the proc's
+ * kthreads have work queued. Smoother than the congestion heuristic, so
+ * single bursts don't trigger a grant.
+ */
+static bool policy_util_check(struct proc *p, uint64_t now)
+{
+    struct thread *th;
+    unsigned int busy = 0, sample;
+    int i;
+
+    if (p->active_thread_count == 0)
+        return false;
+
+    for (i = 0; i < p->active_thread_count; i++) {
+        th = p->active_threads[i];
+        if (ACCESS_ONCE(th->q_ptrs->rq_head) !=
+            load_acquire(&th->q_ptrs->rq_tail) ||
+            ACCESS_ONCE(th->rxq.send_head) != lrpc_poll_send_tail(&th->rxq))
+            busy++;
+    }
+
+    sample = busy * 1024 / p->active_thread_count;
+    p->util += ((int)sample - (int)p->util) >> CORES_UTIL_EWMA_SHIFT;
+
+    return p->util >= CORES_UTIL_THRESH;
+}
+
+static const struct core_policy core_policies[CORE_POLICY_NR] = {
+    [CORE_POLICY_CONGESTION] = {
+        .name       = "congestion",
+        .congested  = policy_congestion_check,
+    },
+    [CORE_POLICY_DELAY] = {
+        .name       = "delay",
+        .congested  = policy_delay_check,
+    },
+    [CORE_POLICY_UTIL] = {
+        .name       = "util",
+        .congested  = policy_util_check,
+    },
+};
+
+static bool cores_is_proc_congested(struct proc *p)
+{
+    const struct core_policy *policy =
+        &core_policies[p->sched_cfg.core_policy];
+    uint64_t now = microtime();
+    bool congested;
+
+    congested = policy->congested(p, now);
+
+    if (p->pending_timer && now >= p->deadline_us)
+        congested = true;
+
+    return congested;
+}
+
 /*
  * Pins thread tid to core. Returns 0 on success and < 0 on error. Note that
  * this function can always fail with error ESRCH, because threads can be
@@ -632,6 +1202,24 @@ int cores_pin_thread(pid_t tid, int core)
     return 0;
 }
 
+/*
+ * Finds the package whose memory backs the start of the proc's shared region,
+ * assuming NUMA node and package numbers match.
+ */
+static int proc_find_home_pkg(struct proc *p)
+{
+    int node;
+
+    if (get_mempolicy(&node, NULL, 0, p->region.base,
+                      MPOL_F_NODE | MPOL_F_ADDR) < 0 ||
+        node < 0 || node >= NNUMA) {
+        log_warn("cores: couldn't locate memory of runtime pid %d", p->pid);
+        return core_pkg(core_assign.dp_core);
+    }
+
+    return node;
+}
+
 /*
  * Initialize proc state for managing cores.
  */
@@ -651,18 +1239,26 @@ void cores_init_proc(struct proc *p)
             log_err("cores: failed to pin thread %d in cores_init_proc",
                     p->threads[i].tid);
             /* continue running but performance is unpredictable */
+        } else {
+            p->threads[i].pinned_core = core_assign.linux_core;
         }
 
         /* init core to 0 - this will result in incorrect cache locality
          * decisions at first but saves us from always checking if this thread
          * has run yet */
         p->threads[i].core = bitmap_find_next_set(online_cores, NCPU, 0);
+        p->threads[i].delay_rxq_since_us = 0;
         list_add_tail(&p->idle_threads, &p->threads[i].idle_link);
     }
 
     p->bursting = false;
     p->overloaded = false;
     p->launched = true;
+    p->util = 0;
+    p->home_pkg = proc_find_home_pkg(p);
+
+    log_info("cores: runtime pid %d uses the %s core policy", p->pid,
+             core_policies[p->sched_cfg.core_policy].name);
 
     /* wake the first kthread so the runtime can run the main_fn */
     cores_add_core(p);
@@ -683,54 +1279,6 @@ void cores_free_proc(struct proc *p)
         cores_park_kthread(&p->threads[i], true);
 }
 
-static bool cores_is_proc_congested(struct proc *p)
-{
-    struct thread *th;
-    uint32_t rq_tail, rxq_tail, last_rq_head, last_rxq_head;
-    bool congested = false;
-    int i;
-
-    for (i = 0; i < p->active_thread_count; i++) {
-        th = p->active_threads[i];
-
-        /* update the queue positions */
-        rq_tail = load_acquire(&th->q_ptrs->rq_tail);
-        rxq_tail = lrpc_poll_send_tail(&th->rxq);
-        last_rq_head = th->last_rq_head;
-        last_rxq_head = th->last_rxq_head;
-        th->last_rq_head = ACCESS_ONCE(th->q_ptrs->rq_head);
-        th->last_rxq_head = ACCESS_ONCE(th->rxq.send_head);
-
-        /* if one prior queue was congested, no need to find more */
-        if (congested)
-            continue;
-
-        /* if the thread just woke up, give it a pass this round */
-        if (th->waking) {
-            th->waking = false;
-            continue;
-        }
-
-        /* check if the runqueue is congested */
-        if (wraps_lt(rq_tail, last_rq_head)) {
-            congested = true;
-            continue;
-        }
-
-        /* check if the RX queue is congested */
-        if (wraps_lt(rxq_tail, last_rxq_head)) {
-            congested = true;
-            continue;
-        }
-
-    }
-
-    if (p->pending_timer && microtime() >= p->deadline_us)
-        congested = true;
-
-    return congested;
-}
-
 /*
  * Rebalances the allocation of cores to runtimes. Grants more cores to
  * runtimes that would benefit from them.
@@ -738,7 +1286,7 @@ static bool cores_is_proc_congested(struct proc *p)
 void cores_adjust_assignments(void)
 {
     struct proc *p, *next;
-    int i;
+    int i, prio;
 
     /* determine which procs need more cores to meet their guarantees, and
        which procs want more burstable cores */
@@ -753,38 +1301,233 @@ void cores_adjust_assignments(void)
         if (!cores_is_proc_congested(p))
             continue;
 
-        /* the proc is congested, add cores if possible */
-        if (p->active_thread_count < p->sched_cfg.guaranteed_cores)
+        /* the proc is congested, add cores if possible, preempting a less
+           important class right away if none are idle */
+        if (p->active_thread_count < p->sched_cfg.guaranteed_cores ||
+            (nr_avail_cores == 0 && get_victim_prio(p) >= 0))
             cores_add_core(p);
         else
             proc_set_overloaded(p);
     }
 
-    /* grant cores to procs that are bursting until we run out of cores */
-    list_for_each_safe(&overloaded_procs, p, next, overloaded_link) {
-        if (nr_avail_cores == 0)
-            break;
+    /* grant cores to procs that are bursting until we run out of cores,
+       most important class first */
+    for (prio = 0; prio < SCHED_PRIORITY_NR; prio++) {
+        list_for_each_safe(&overloaded_procs[prio], p, next,
+                           overloaded_link) {
+            if (nr_avail_cores == 0)
+                return;
+
+            cores_add_core(p);
+        }
+    }
+}
+
+/**
+ * cores_idle - checks if core assignments can't change without an event
+ * @deadline_us: set to the earliest pending runtime timer, or 0 if none
+ *
+ * Returns true if no kthreads are running (so no runtime can produce work or
+ * park) and no proc is waiting for a core.
+ */
+bool cores_idle(uint64_t *deadline_us)
+{
+    struct proc *p;
+    int i;
+
+    *deadline_us = 0;
+    if (nrts > 0 || !no_overloaded_procs())
+        return false;
 
-        cores_add_core(p);
+    for (i = 0; i < dp.nr_clients; i++) {
+        p = dp.clients[i];
+        if (!p->pending_timer)
+            continue;
+        if (!*deadline_us || p->deadline_us < *deadline_us)
+            *deadline_us = p->deadline_us;
     }
+
+    return true;
+}
+
+/* cores explicitly selected on the command line, if any */
+static DEFINE_BITMAP(managed_cores, NCPU);
+static bool managed_cores_set;
+
+/**
+ * cores_set_managed - restricts the cores handed out to runtimes
+ * @list: a cpu list (e.g. "2-7,10")
+ *
+ * Overrides the default pool of isolated cores. Must be called before
+ * cores_init(). Returns 0 if successful.
+ */
+int cores_set_managed(const char *list)
+{
+    int ret;
+
+    ret = parse_bitlist(list, managed_cores, NCPU);
+    if (ret)
+        return ret;
+
+    managed_cores_set = true;
+    return 0;
 }
 
 /*
- * Initialize core state.
+ * Reads the cpus hwallocd may use: the effective cpuset of its cgroup (v2),
+ * or its affinity mask if the cgroup doesn't expose one.
  */
-int cores_init(void)
+static void cores_read_cpuset(unsigned long *mask)
 {
-    int i, j;
+    char buf[PATH_MAX - 64], path[PATH_MAX];
+    cpu_set_t cpuset;
+    FILE *f;
+    int i;
+
+    f = fopen("/proc/self/cgroup", "r");
+    if (f) {
+        while (fgets(buf, sizeof(buf), f)) {
+            /* the unified hierarchy is listed as "0::<path>" */
+            if (strncmp(buf, "0::", 3))
+                continue;
+            buf[strcspn(buf, "\n")] = '\0';
+            snprintf(path, sizeof(path),
+                     "/sys/fs/cgroup%s/cpuset.cpus.effective", &buf[3]);
+            if (!sysfs_parse_bitlist(path, mask, NCPU) &&
+                bitmap_find_next_set(mask, NCPU, 0) < NCPU) {
+                fclose(f);
+                return;
+            }
+        }
+        fclose(f);
+    }
+
+    bitmap_init(mask, NCPU, false);
+    if (sched_getaffinity(0, sizeof(cpuset), &cpuset) < 0) {
+        log_warn("cores: couldn't read affinity mask, using all cores");
+        bitmap_init(mask, cpu_count, true);
+        return;
+    }
+    for (i = 0; i < cpu_count; i++) {
+        if (CPU_ISSET(i, &cpuset))
+            bitmap_set(mask, i);
+    }
+}
+
+/* reads a kernel cpu list, treating a missing file as an empty list */
+static void cores_read_kernel_list(const char *path, unsigned long *mask)
+{
+    if (sysfs_parse_bitlist(path, mask, NCPU))
+        bitmap_init(mask, NCPU, false);
+}
+
+/* finds a housekeeping core for linux and control, preferring @pkg */
+static int find_housekeeping_core(unsigned long *housekeeping, int pkg)
+{
+    int i, fallback = -1;
+
+    bitmap_for_each_set(housekeeping, cpu_count, i) {
+        if (core_pkg(i) == pkg)
+            return i;
+        if (fallback < 0)
+            fallback = i;
+    }
+
+    return fallback;
+}
+
+/*
+ * Builds the pool of cores granted to runtimes. By default this is the
+ * isolated (isolcpus) cores within hwallocd's cpuset, so that kernel
+ * housekeeping stays on the remaining cores; the dataplane takes the first
+ * pooled core and linux and the control thread share a housekeeping core.
+ * Without isolated cores every core in the cpuset is pooled, as before.
+ */
+static void cores_build_pool(unsigned long *pool)
+{
+    DEFINE_BITMAP(cpuset, NCPU);
+    DEFINE_BITMAP(isolated, NCPU);
+    DEFINE_BITMAP(nohz_full, NCPU);
+    DEFINE_BITMAP(housekeeping, NCPU);
+    int i, core, dp_core = -1;
+    bool any_isolated = false;
+
+    cores_read_cpuset(cpuset);
+    cores_read_kernel_list("/sys/devices/system/cpu/isolated", isolated);
+    cores_read_kernel_list("/sys/devices/system/cpu/nohz_full", nohz_full);
+
+    bitmap_init(pool, NCPU, false);
+    for (i = 0; i < cpu_count; i++) {
+        if (!bitmap_test(cpuset, i))
+            continue;
+
+        if (managed_cores_set) {
+            if (bitmap_test(managed_cores, i))
+                bitmap_set(pool, i);
+        } else if (bitmap_test(isolated, i)) {
+            bitmap_set(pool, i);
+            any_isolated = true;
+        }
+    }
+
+    if (managed_cores_set) {
+        bitmap_for_each_set(managed_cores, NCPU, i) {
+            if (i >= cpu_count || !bitmap_test(cpuset, i))
+                log_warn("cores: core %d is outside our cpuset, ignoring", i);
+        }
+    } else if (!any_isolated) {
+        log_warn("cores: no isolated cores in our cpuset, managing all of "
+                 "them; kernel housekeeping may interrupt granted cores");
+        for (i = 0; i < cpu_count; i++) {
+            if (bitmap_test(cpuset, i))
+                bitmap_set(pool, i);
+        }
+    }
 
-    /* assign first non-zero core on the same socket as core 0
-     * to the dataplane thread */
-    for (i = 1; i < cpu_count; i++) {
-        if (cpu_info_tbl[i].package == cpu_info_tbl[0].package)
+    /* assign the first pooled core other than 0 to the dataplane thread */
+    bitmap_for_each_set(pool, cpu_count, i) {
+        if (i != 0) {
+            dp_core = i;
             break;
+        }
+    }
+    if (dp_core < 0)
+        panic("cores: couldn't find a core for the dataplane");
+    core_assign.dp_core = dp_core;
+    bitmap_clear(pool, dp_core);
+
+    for (i = 0; i < cpu_count; i++) {
+        if (bitmap_test(cpuset, i) && !bitmap_test(pool, i) && i != dp_core)
+            bitmap_set(housekeeping, i);
+        else
+            bitmap_clear(housekeeping, i);
+    }
+
+    /* linux and the control thread share a housekeeping core, or, if there
+     * are none, the dataplane's sibling */
+    core = find_housekeeping_core(housekeeping, core_pkg(dp_core));
+    if (core < 0) {
+        core = cpu_to_sibling_cpu(dp_core);
+        bitmap_clear(pool, core);
     }
-    if (i == cpu_count)
-        panic("cores: couldn't find any cores on package 0");
-    core_assign.dp_core = i;
+    core_assign.linux_core = core;
+    core_assign.ctrl_core = core;
+
+    bitmap_for_each_set(pool, cpu_count, i) {
+        if (!bitmap_test(isolated, i) && !bitmap_test(nohz_full, i)) {
+            log_warn("cores: managed core %d is neither isolated nor "
+                     "nohz_full", i);
+        }
+    }
+}
+
+/*
+ * Initialize core state.
+ */
+int cores_init(void)
+{
+    DEFINE_BITMAP(pool, NCPU);
+    int i, j, core;
 
 #ifndef CORES_NOHT
     /* parse hyperthread information */
@@ -804,17 +1547,25 @@ int cores_init(void)
         }
 
         if (0 == siblings) {
-            /* TODO: parse cache topology to guide the sibling set for
-             * no-SMT processors
-             */
+            /* no SMT, so pair with a core sharing the L2 instead */
             cpu_siblings[i] = i ^ 0x01;
+            bitmap_for_each_set(cpu_info_tbl[i].l2_siblings_mask,
+                        cpu_count, j) {
+                if (i != j) {
+                    cpu_siblings[i] = j;
+                    break;
+                }
+            }
         }
     }
 #endif
 
-    /* assign the dataplane's sibling to linux and the control thread */
-    core_assign.linux_core = cpu_to_sibling_cpu(core_assign.dp_core);
-    core_assign.ctrl_core = cpu_to_sibling_cpu(core_assign.dp_core);
+    cores_build_pool(pool);
+
+    for (i = 0; i < SCHED_PRIORITY_NR; i++) {
+        list_head_init(&overloaded_procs[i]);
+        list_head_init(&bursting_procs[i]);
+    }
 
     /* mark all cores as unavailable */
     bitmap_init(avail_cores, cpu_count, false);
@@ -823,8 +1574,8 @@ int cores_init(void)
     bitmap_init(online_cores, cpu_count, false);
 
 
-    /* find cores on socket 0 that are not already in use */
-    for (i = 0; i < cpu_count; i++) {
+    /* find pooled cores on every socket that are not already in use */
+    bitmap_for_each_set(pool, cpu_count, i) {
         if (i == core_assign.linux_core ||
             i == core_assign.ctrl_core ||
             i == core_assign.dp_core) {
@@ -839,13 +1590,32 @@ int cores_init(void)
             continue;
 #endif
 
-        if (cpu_info_tbl[i].package == cpu_info_tbl[0].package)
-            core_init(i);
+        if (core_pkg(i) >= NNUMA) {
+            log_warn("cores: core %d is on unsupported package %d",
+                     i, core_pkg(i));
+            continue;
+        }
+
+        core_init(i);
+        bitmap_set(pkg_cores[core_pkg(i)], i);
+    }
+
+    for (i = 0; i < NNUMA; i++) {
+        j = 0;
+        bitmap_for_each_set(pkg_cores[i], cpu_count, core)
+            j++;
+        if (j)
+            log_info("cores: managing %d cores on package %d", j, i);
     }
 
     log_info("cores: linux on core %d, control on %d, dataplane on %d",
          core_assign.linux_core, core_assign.ctrl_core,
          core_assign.dp_core);
 
+    /* the calling thread goes on to run the dataplane loop */
+    if (cores_pin_thread(thread_gettid(), core_assign.dp_core))
+        log_warn("cores: couldn't pin the dataplane to core %d",
+                 core_assign.dp_core);
+
     return 0;
 }
@@ -1,9 +1,20 @@
 /*
  * dataplane.c - functions for dataplane operations
+ *
+ * The dataplane polls while any runtime kthread holds a core. Once none does
+ * (and no proc is waiting for one) it polls for HWALLOCD_IDLE_SPIN_US longer,
+ * then sleeps until the control plane kicks it or the earliest runtime timer
+ * expires. Runtimes can't produce work with every kthread parked, so nothing
+ * else needs to wake it.
  */
 
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
 #include <base/log.h>
 #include <base/lrpc.h>
+#include <base/time.h>
 
 #include "defs.h"
 
@@ -11,6 +22,17 @@ static struct lrpc_chan_out lrpc_data_to_control;
 static struct lrpc_chan_in lrpc_control_to_data;
 struct dataplane dp;
 
+/* idle time and wake-up latency, reported every HWALLOCD_STATS_INTERVAL_US */
+static struct {
+    uint64_t    start_us;
+    uint64_t    sleep_us;
+    uint64_t    sleeps;
+    uint64_t    kick_wakes;
+    uint64_t    kick_lat_us;
+    uint64_t    timer_wakes;
+    uint64_t    timer_lat_us;
+} dp_stats;
+
 /*
  * Add a new client.
  */
@@ -26,8 +48,11 @@ void proc_release(struct ref *r)
 {
     struct proc *p = container_of(r, struct proc, ref);
     if (!lrpc_send(&lrpc_data_to_control, CONTROLPLANE_REMOVE_CLIENT,
-            (unsigned long) p))
+            (unsigned long) p)) {
         log_err("dp_clients: failed to inform control of client removal");
+        return;
+    }
+    control_kick();
 }
 
 /*
@@ -89,13 +114,112 @@ static void dp_clients_rx_control_lrpcs()
     }
 }
 
+/**
+ * dataplane_kick - wakes the dataplane if it is sleeping
+ *
+ * Called by the control plane after sending a command to the dataplane.
+ */
+void dataplane_kick(void)
+{
+    uint64_t val = 1;
+    ssize_t ret;
+
+    /* order the command before checking whether the dataplane sleeps */
+    mb();
+    if (!ACCESS_ONCE(dp.sleeping))
+        return;
+
+    ACCESS_ONCE(dp.kick_us) = microtime();
+    ret = write(dp.wake_efd, &val, sizeof(val));
+    WARN_ON_ONCE(ret != sizeof(val));
+}
+
+static void dp_stats_report(uint64_t now)
+{
+    uint64_t elapsed = now - dp_stats.start_us;
+
+    if (elapsed < HWALLOCD_STATS_INTERVAL_US)
+        return;
+
+    if (dp_stats.sleeps) {
+        log_info("dataplane: idle %.1f%% (%lu sleeps), wake latency "
+             "%.1f us on kick (%lu), %.1f us on timer (%lu)",
+             100.0 * dp_stats.sleep_us / elapsed, dp_stats.sleeps,
+             dp_stats.kick_wakes ?
+             (double)dp_stats.kick_lat_us / dp_stats.kick_wakes : 0.0,
+             dp_stats.kick_wakes,
+             dp_stats.timer_wakes ?
+             (double)dp_stats.timer_lat_us / dp_stats.timer_wakes : 0.0,
+             dp_stats.timer_wakes);
+    }
+
+    cores_log_stats();
+
+    memset(&dp_stats, 0, sizeof(dp_stats));
+    dp_stats.start_us = now;
+}
+
+/*
+ * Sleep until kicked by the control plane or until @deadline_us (if nonzero).
+ */
+static void dp_sleep(uint64_t deadline_us)
+{
+    struct pollfd pfd = { .fd = dp.wake_efd, .events = POLLIN };
+    struct timespec ts, *tsp = NULL;
+    uint64_t start, now, val, kick_us;
+    int ret;
+
+    ACCESS_ONCE(dp.sleeping) = true;
+    mb();
+
+    /* recheck for a command that raced with going to sleep */
+    if (!lrpc_empty(&lrpc_control_to_data))
+        goto out;
+
+    start = microtime();
+    if (deadline_us) {
+        if (deadline_us <= start)
+            goto out;
+        ts.tv_sec = (deadline_us - start) / ONE_SECOND;
+        ts.tv_nsec = (deadline_us - start) % ONE_SECOND * 1000;
+        tsp = &ts;
+    }
+
+    ret = ppoll(&pfd, 1, tsp, NULL);
+    now = microtime();
+    dp_stats.sleeps++;
+    dp_stats.sleep_us += now - start;
+
+    if (ret > 0) {
+        if (read(dp.wake_efd, &val, sizeof(val)) != sizeof(val))
+            WARN();
+        /* a stale kick from before we slept doesn't count */
+        kick_us = ACCESS_ONCE(dp.kick_us);
+        if (kick_us >= start) {
+            dp_stats.kick_wakes++;
+            dp_stats.kick_lat_us += now - kick_us;
+        }
+    } else if (ret == 0) {
+        dp_stats.timer_wakes++;
+        dp_stats.timer_lat_us += now - deadline_us;
+    } else if (errno != EINTR) {
+        log_err("dataplane: ppoll() failed [%s]", strerror(errno));
+    }
+
+out:
+    ACCESS_ONCE(dp.sleeping) = false;
+}
+
 /*
  * The main dataplane loop.
  */
 void dataplane_loop()
 {
     bool work_done;
-    uint64_t now, last_time = microtime();
+    uint64_t now, deadline_us, last_time = microtime();
+    uint64_t last_busy = last_time;
+
+    dp_stats.start_us = last_time;
 
     /* run until quit or killed */
     for (;;) {
@@ -113,8 +237,32 @@ void dataplane_loop()
         /* adjust core assignments */
         if (now - last_time > CORES_ADJUST_INTERVAL_US) {
             cores_adjust_assignments();
+            dp_stats_report(now);
             last_time = now;
         }
+
+        /* pin kthreads woken on new cores during this iteration */
+        cores_flush_repins();
+
+        /* fall back to signals for kthreads slow to honor preemption */
+        cores_check_preempts(now);
+
+        if (dp.busy_poll)
+            continue;
+
+        /* keep polling while any runtime is running or recently was */
+        if (nrts > 0 || !lrpc_empty(&lrpc_control_to_data))
+            last_busy = now;
+        if (now - last_busy < HWALLOCD_IDLE_SPIN_US)
+            continue;
+
+        if (!cores_idle(&deadline_us)) {
+            last_busy = now;
+            continue;
+        }
+
+        dp_sleep(deadline_us);
+        last_busy = microtime();
     }
 }
 
@@ -143,5 +291,14 @@ int dataplane_init(void)
 
     dp.nr_clients = 0;
 
+    dp.wake_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dp.wake_efd < 0) {
+        log_err("dp_clients: eventfd() failed [%s]", strerror(errno));
+        return -errno;
+    }
+
+    if (dp.busy_poll)
+        log_info("dataplane: busy polling");
+
     return 0;
 }
@@ -17,13 +17,28 @@
 /*
  * Constant limits
  */
-#define HWALLOCD_MAX_PROC             1024
+#define HWALLOCD_MAX_PROC             2048
 #define HWALLOCD_CMD_BURST_SIZE       64
 #define HWALLOCD_CONTROL_BURST_SIZE   4
 
 
 #define CORES_ADJUST_INTERVAL_US      5
 
+/* CORE_POLICY_DELAY target when neither runtime nor command line set one */
+#define CORES_DEFAULT_DELAY_US        10
+/* CORE_POLICY_UTIL adds a core above this average utilization (of 1024) */
+#define CORES_UTIL_THRESH             922
+/* CORE_POLICY_UTIL moving average weight of each new sample (log2) */
+#define CORES_UTIL_EWMA_SHIFT         3
+
+/* how long a kthread has to honor the preempt flag before it is signalled */
+#define CORES_PREEMPT_TIMEOUT_US      20
+
+/* how long the dataplane keeps polling after it runs out of work */
+#define HWALLOCD_IDLE_SPIN_US         100
+/* how often the dataplane reports its idle time and wake-up latency */
+#define HWALLOCD_STATS_INTERVAL_US    (10 * ONE_SECOND)
+
 /*
  * Process Support
  */
@@ -34,7 +49,7 @@ struct thread {
     struct proc            *p;
     unsigned int           parked:1;
     unsigned int           waking:1;
-    unsigned int           reaffinitize:1;
+    unsigned int           repin_pending:1;
     struct lrpc_chan_out   rxq;
     struct lrpc_chan_in    txq;
     pid_t                  tid;
@@ -42,9 +57,14 @@ struct thread {
     struct q_ptrs          *q_ptrs;
     uint32_t               last_rq_head;
     uint32_t               last_rxq_head;
+    /* RX queue position and time for estimating its queueing delay */
+    uint32_t               delay_rxq_head;
+    uint64_t               delay_rxq_since_us;
     /* current or most recent core this thread ran on, depending on whether
      * this thread is parked or not */
     unsigned int           core;
+    /* the core this thread's affinity is set to, or -1 if unknown */
+    int                    pinned_core;
     /* the @ts index (if active) */
     unsigned int           ts_idx;
     /* the proc->active_threads index (if active) */
@@ -62,6 +82,7 @@ struct proc {
     unsigned int        overloaded:1; /* the proc needs more cores */
     unsigned int        bursting:1;   /* the proc is using past resv. */
     unsigned int        launched:1;   /* executing the first time */
+    unsigned int        park_futex:1; /* kthreads park on q_ptrs->park_word */
 
     /* intrusive list links */
     struct list_node    overloaded_link;
@@ -69,6 +90,8 @@ struct proc {
 
     /* scheduler data */
     struct sched_spec   sched_cfg;
+    int                 home_pkg; /* package holding the shared memory */
+    unsigned int        util; /* CORE_POLICY_UTIL average, in 1/1024ths */
 
     /* runtime threads */
     unsigned int        thread_count;
@@ -89,6 +112,10 @@ struct proc {
     /* Unique identifier -- never recycled across runtimes*/
     uintptr_t           uniqid;
 
+    /* control plane connection (owned by the control thread) */
+    int                 control_fd;
+    int                 control_idx;
+
     /* table of physical addresses for shared memory */
     physaddr_t          page_paddrs[];
 };
@@ -160,6 +187,7 @@ struct lrpc_params {
 };
 extern struct lrpc_params lrpc_control_to_data_params;
 extern struct lrpc_params lrpc_data_to_control_params;
+extern void control_kick(void);
 
 /*
  * Commands from control plane to dataplane.
@@ -185,6 +213,12 @@ struct dataplane {
     uint8_t            port;
     struct proc        *clients[HWALLOCD_MAX_PROC];
     int                nr_clients;
+
+    /* adaptive polling (set by the dataplane, read by the control plane) */
+    bool               busy_poll;
+    bool               sleeping;
+    int                wake_efd;
+    uint64_t           kick_us;
 };
 
 extern struct dataplane dp;
@@ -214,11 +248,14 @@ extern bool rx_send_to_runtime(struct proc *p, uint32_t hash, uint64_t cmd,
 extern int cores_init(void);
 extern int control_init(void);
 extern int dataplane_init();
+extern int hwalloc_parse_args(int nargs, char *args[]);
+extern int hwalloc_init(void);
 
 /*
  * other dataplane functions
  */
 extern void dataplane_loop();
+extern void dataplane_kick(void);
 extern bool commands_recv();
 
 /*
@@ -227,9 +264,18 @@ extern bool commands_recv();
 extern void cores_init_proc(struct proc *p);
 extern void cores_free_proc(struct proc *p);
 extern int cores_pin_thread(pid_t tid, int core);
+extern int cores_set_managed(const char *list);
+extern void cores_flush_repins(void);
+extern void cores_check_preempts(uint64_t now_us);
+extern uint64_t cores_rxq_delay_us(uint32_t head, uint32_t tail,
+                                   uint32_t *since_head, uint64_t *since_us,
+                                   uint64_t now);
+extern void cores_log_stats(void);
 extern bool cores_park_kthread(struct thread *t, bool force);
 extern struct thread *cores_add_core(struct proc *p);
 extern void cores_adjust_assignments();
+extern bool cores_idle(uint64_t *deadline_us);
+extern unsigned int cores_default_delay_us;
 extern void proc_set_overloaded(struct proc *p);
 extern unsigned int get_nr_avail_cores(void);
 extern unsigned int get_total_cores(void);
@@ -0,0 +1,75 @@
+/*
+ * init.c - argument parsing and initialization for the hwallocd, shared by
+ * the daemon and the in-process simulator
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/init.h>
+#include <base/log.h>
+#include <base/stddef.h>
+
+#include "defs.h"
+
+/* hwallocd subsystem initialization */
+static const struct init_handler base_init_handlers[] = {
+    /* base */
+    BASE_INITIALIZER(base),
+
+    /* hardware resources */
+    BASE_INITIALIZER(cores),
+
+    /* control plane */
+    BASE_INITIALIZER(control),
+
+    /* data plane */
+    BASE_INITIALIZER(dataplane),
+};
+
+/**
+ * hwalloc_parse_args - applies hwallocd options
+ * @nargs: the number of options
+ * @args: the options, without the program name
+ *
+ * Returns 0 if successful, otherwise -EINVAL.
+ */
+int hwalloc_parse_args(int nargs, char *args[])
+{
+    int i;
+
+    for (i = 0; i < nargs; i++) {
+        if (!strcmp(args[i], "busypoll")) {
+            /* never let the dataplane sleep, trading a core for latency */
+            dp.busy_poll = true;
+        } else if (!strcmp(args[i], "delay_us") && i + 1 < nargs) {
+            /* queueing delay target for runtimes using the delay policy */
+            cores_default_delay_us = atoi(args[++i]);
+        } else if (!strcmp(args[i], "cores") && i + 1 < nargs) {
+            /* grant only these cores to runtimes, e.g. "cores 2-7,10" */
+            if (cores_set_managed(args[++i])) {
+                log_err("invalid core list '%s'", args[i]);
+                return -EINVAL;
+            }
+        } else {
+            log_err("invalid argument '%s'", args[i]);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * hwalloc_init - initializes every hwallocd subsystem
+ *
+ * The calling thread is pinned to the dataplane core and must go on to run
+ * dataplane_loop().
+ *
+ * Returns 0 if successful.
+ */
+int hwalloc_init(void)
+{
+    return run_init_handlers("hwallocd", base_init_handlers,
+            ARRAY_SIZE(base_init_handlers));
+}
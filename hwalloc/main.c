@@ -3,33 +3,17 @@
  * (was named iokernel/iok/IOK in Shenango)
  */
 
-#include <base/init.h>
-#include <base/log.h>
-#include <base/stddef.h>
-
 #include "defs.h"
 
-/* hwallocd subsystem initialization */
-static const struct init_handler base_init_handlers[] = {
-    /* base */
-    BASE_INITIALIZER(base),
-
-    /* hardware resources */
-    BASE_INITIALIZER(cores),
-
-    /* control plane */
-    BASE_INITIALIZER(control),
-
-    /* data plane */
-    BASE_INITIALIZER(dataplane),
-};
-
 int main(int argc, char *argv[])
 {
     int ret;
 
-    ret = run_init_handlers("hwallocd", base_init_handlers,
-            ARRAY_SIZE(base_init_handlers));
+    ret = hwalloc_parse_args(argc - 1, &argv[1]);
+    if (ret)
+        return ret;
+
+    ret = hwalloc_init();
     if (ret)
         return ret;
 
@@ -0,0 +1,64 @@
+/*
+ * sim.c - runs the hwallocd on a helper thread inside the calling process
+ *
+ * Linked from libhwalloc-sim.a so tests and benchmarks can exercise the
+ * control plane, dataplane and core allocation without a separately started
+ * daemon, and profile both sides in one process.
+ */
+
+#include <pthread.h>
+
+#include <base/log.h>
+#include <hwalloc/sim.h>
+
+#include "defs.h"
+
+static pthread_t sim_tid;
+static pthread_barrier_t sim_barrier;
+static int sim_ret;
+
+static void *sim_entry(void *arg)
+{
+    sim_ret = hwalloc_init();
+    pthread_barrier_wait(&sim_barrier);
+    if (sim_ret)
+        return NULL;
+
+    dataplane_loop();
+    return NULL;
+}
+
+/**
+ * hwalloc_sim_start - starts an in-process hwallocd
+ * @nargs: the number of hwallocd options
+ * @args: the options (e.g. "busypoll"), without a program name
+ *
+ * Must be called before runtime_init(). Returns once the hwallocd accepts
+ * runtimes, 0 if successful, otherwise < 0.
+ */
+int hwalloc_sim_start(int nargs, char *args[])
+{
+    int ret;
+
+    ret = hwalloc_parse_args(nargs, args);
+    if (ret)
+        return ret;
+
+    pthread_barrier_init(&sim_barrier, NULL, 2);
+    ret = pthread_create(&sim_tid, NULL, sim_entry, NULL);
+    if (ret) {
+        log_err("sim: pthread_create() failed, ret = %d", ret);
+        pthread_barrier_destroy(&sim_barrier);
+        return -ret;
+    }
+
+    pthread_barrier_wait(&sim_barrier);
+    pthread_barrier_destroy(&sim_barrier);
+    if (sim_ret) {
+        pthread_join(sim_tid, NULL);
+        return sim_ret;
+    }
+
+    log_info("sim: hwallocd running in-process");
+    return 0;
+}
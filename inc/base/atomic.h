@@ -162,6 +162,11 @@ static inline int atomic_cmpxchg_val(atomic_t *a, int oldv, int newv)
     return __sync_val_compare_and_swap(&a->cnt, oldv, newv);
 }
 
+static inline int atomic_xchg(atomic_t *a, int val)
+{
+    return __atomic_exchange_n(&a->cnt, val, __ATOMIC_SEQ_CST);
+}
+
 static inline long atomic64_read(const atomic64_t *a)
 {
     return *((volatile long *)&a->cnt);
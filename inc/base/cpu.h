@@ -20,6 +20,7 @@ struct cpu_info {
     DEFINE_BITMAP(thread_siblings_mask, NCPU);
     DEFINE_BITMAP(core_siblings_mask, NCPU);
     DEFINE_BITMAP(l2_siblings_mask, NCPU);
+    DEFINE_BITMAP(llc_siblings_mask, NCPU); /* package if no L3 */
     int package;
     int cluster;
 };
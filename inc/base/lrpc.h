@@ -8,6 +8,8 @@
 
 #pragma once
 
+#include <string.h>
+
 #include <base/stddef.h>
 #include <base/assert.h>
 #include <base/atomic.h>
@@ -66,6 +68,45 @@ static inline bool lrpc_send(struct lrpc_chan_out *chan, uint64_t cmd,
     return true;
 }
 
+/**
+ * lrpc_send_burst - sends a burst of messages on the channel
+ * @chan: the egress channel
+ * @msgs: the messages to send
+ * @nr: the number of messages
+ *
+ * The receiver's head is polled at most once, and all payloads are written
+ * behind a single barrier before the commands are published.
+ *
+ * Returns the number of messages sent (fewer than @nr if the channel is full).
+ */
+static inline unsigned int lrpc_send_burst(struct lrpc_chan_out *chan,
+                       const struct lrpc_msg *msgs,
+                       unsigned int nr)
+{
+    uint32_t head = chan->send_head;
+    unsigned int i;
+
+    if (chan->size - (head - chan->send_tail) < nr)
+        chan->send_tail = load_acquire(chan->recv_head_wb);
+    nr = libut_min(nr, chan->size - (head - chan->send_tail));
+
+    for (i = 0; i < nr; i++) {
+        assert(!(msgs[i].cmd & LRPC_DONE_PARITY));
+        chan->tbl[(head + i) & (chan->size - 1)].payload = msgs[i].payload;
+    }
+
+    wmb();
+    for (i = 0; i < nr; i++) {
+        uint64_t cmd = msgs[i].cmd;
+
+        cmd |= ((head + i) & chan->size) ? 0 : LRPC_DONE_PARITY;
+        ACCESS_ONCE(chan->tbl[(head + i) & (chan->size - 1)].cmd) = cmd;
+    }
+
+    chan->send_head = head + nr;
+    return nr;
+}
+
 /**
  * lrpc_get_cached_send_window - retrieves the last known number of slots
  * available for sending
@@ -149,6 +190,45 @@ static inline bool lrpc_recv(struct lrpc_chan_in *chan, uint64_t *cmd_out,
     return true;
 }
 
+/**
+ * lrpc_recv_burst - receives a burst of messages on the channel
+ * @chan: the ingress channel
+ * @msgs: an array to store the received messages
+ * @nr: the maximum number of messages to receive
+ *
+ * Unlike calling lrpc_recv() in a loop, the head is written back to the
+ * sender only once for the whole burst.
+ *
+ * Returns the number of messages received (0 if the channel is empty).
+ */
+static inline unsigned int lrpc_recv_burst(struct lrpc_chan_in *chan,
+                       struct lrpc_msg *msgs,
+                       unsigned int nr)
+{
+    uint32_t head = chan->recv_head;
+    unsigned int i;
+
+    for (i = 0; i < nr; i++) {
+        struct lrpc_msg *m = &chan->tbl[(head + i) & (chan->size - 1)];
+        uint64_t parity = ((head + i) & chan->size) ?
+                  0 : LRPC_DONE_PARITY;
+        uint64_t cmd;
+
+        cmd = load_acquire(&m->cmd);
+        if ((cmd & LRPC_DONE_PARITY) != parity)
+            break;
+
+        msgs[i].cmd = cmd & LRPC_CMD_MASK;
+        msgs[i].payload = m->payload;
+    }
+
+    if (i) {
+        chan->recv_head = head + i;
+        store_release(chan->recv_head_wb, chan->recv_head);
+    }
+    return i;
+}
+
 /**
  * lrpc_empty - returns true if the channel has no available messages
  * @chan: the ingress channel
@@ -164,6 +244,164 @@ static inline bool lrpc_empty(struct lrpc_chan_in *chan)
 extern int lrpc_init_in(struct lrpc_chan_in *chan, struct lrpc_msg *tbl,
             unsigned int size, uint32_t *recv_head_wb);
 
+
+/*
+ * Cache Line Channel Support
+ *
+ * A variant whose ring slots are whole cache lines, so message bodies travel
+ * inline with the command instead of through a pointer into shared memory.
+ * Larger messages span up to LRPC_LINE_MAX_SLOTS consecutive slots. Every
+ * slot carries the same parity bit scheme as struct lrpc_msg; the first slot
+ * of a message is published last, so a receiver that sees it ready can read
+ * the rest of the message without further checks.
+ */
+
+#define LRPC_LINE_DATA_LEN     (CACHE_LINE_SIZE - 2 * sizeof(uint64_t))
+#define LRPC_LINE_MAX_SLOTS    8
+#define LRPC_LINE_MAX_LEN      (LRPC_LINE_DATA_LEN * LRPC_LINE_MAX_SLOTS)
+
+struct lrpc_line {
+    uint64_t         cmd;  /* parity bit | command (first slot only) */
+    uint32_t         len;  /* message length (first slot only) */
+    uint32_t         pad;
+    uint8_t          data[LRPC_LINE_DATA_LEN];
+} __aligned(CACHE_LINE_SIZE);
+
+struct lrpc_line_chan_out {
+    struct lrpc_line *tbl;
+    uint32_t    *recv_head_wb;
+    uint32_t    send_head;
+    uint32_t    send_tail;
+    uint32_t    size;
+    uint32_t    pad;
+};
+
+struct lrpc_line_chan_in {
+    struct lrpc_line *tbl;
+    uint32_t    *recv_head_wb;
+    uint32_t    recv_head;
+    uint32_t    size;
+};
+
+/* the number of ring slots a message of @len bytes occupies */
+static inline unsigned int lrpc_line_slots(size_t len)
+{
+    return len ? div_up(len, LRPC_LINE_DATA_LEN) : 1;
+}
+
+static inline uint64_t lrpc_line_parity(uint32_t pos, uint32_t size)
+{
+    return (pos & size) ? 0 : LRPC_DONE_PARITY;
+}
+
+/**
+ * lrpc_line_send - sends a message with an inline body on the channel
+ * @chan: the egress channel
+ * @cmd: the command to send
+ * @buf: the message body
+ * @len: the length of @buf (at most LRPC_LINE_MAX_LEN)
+ *
+ * Returns true if successful, otherwise the channel is full.
+ */
+static inline bool lrpc_line_send(struct lrpc_line_chan_out *chan,
+                  uint64_t cmd, const void *buf, size_t len)
+{
+    const uint8_t *src = (const uint8_t *)buf;
+    unsigned int i, nr = lrpc_line_slots(len);
+    uint32_t head = chan->send_head;
+    struct lrpc_line *dst;
+    size_t off;
+
+    assert(!(cmd & LRPC_DONE_PARITY));
+    assert(len <= LRPC_LINE_MAX_LEN && nr <= chan->size);
+
+    if (unlikely(chan->size - (head - chan->send_tail) < nr)) {
+        chan->send_tail = load_acquire(chan->recv_head_wb);
+        if (chan->size - (head - chan->send_tail) < nr)
+            return false;
+    }
+
+    /* fill in the continuation slots first... */
+    for (i = 1, off = LRPC_LINE_DATA_LEN; i < nr;
+         i++, off += LRPC_LINE_DATA_LEN) {
+        dst = &chan->tbl[(head + i) & (chan->size - 1)];
+        memcpy(dst->data, src + off,
+               libut_min(len - off, LRPC_LINE_DATA_LEN));
+        dst->cmd = lrpc_line_parity(head + i, chan->size);
+    }
+
+    /* ...then publish the message through its first slot */
+    dst = &chan->tbl[head & (chan->size - 1)];
+    dst->len = len;
+    if (len)
+        memcpy(dst->data, src, libut_min(len, LRPC_LINE_DATA_LEN));
+    store_release(&dst->cmd, cmd | lrpc_line_parity(head, chan->size));
+    chan->send_head = head + nr;
+    return true;
+}
+
+/**
+ * lrpc_line_recv - receives a message with an inline body on the channel
+ * @chan: the ingress channel
+ * @cmd_out: a pointer to store the received command
+ * @buf: a buffer to store the message body
+ * @buf_len: the size of @buf
+ *
+ * Returns the length of the message, -EAGAIN if the channel is empty, or
+ * -EMSGSIZE if @buf is too small (the message is left in the channel).
+ */
+static inline int lrpc_line_recv(struct lrpc_line_chan_in *chan,
+                 uint64_t *cmd_out, void *buf, size_t buf_len)
+{
+    uint32_t head = chan->recv_head;
+    struct lrpc_line *m = &chan->tbl[head & (chan->size - 1)];
+    uint8_t *dst = (uint8_t *)buf;
+    unsigned int i, nr;
+    uint64_t cmd;
+    size_t len, off;
+
+    cmd = load_acquire(&m->cmd);
+    if ((cmd & LRPC_DONE_PARITY) != lrpc_line_parity(head, chan->size))
+        return -EAGAIN;
+
+    len = m->len;
+    if (unlikely(len > buf_len))
+        return -EMSGSIZE;
+
+    nr = lrpc_line_slots(len);
+    if (len)
+        memcpy(dst, m->data, libut_min(len, LRPC_LINE_DATA_LEN));
+    for (i = 1, off = LRPC_LINE_DATA_LEN; i < nr;
+         i++, off += LRPC_LINE_DATA_LEN) {
+        m = &chan->tbl[(head + i) & (chan->size - 1)];
+        memcpy(dst + off, m->data,
+               libut_min(len - off, LRPC_LINE_DATA_LEN));
+    }
+
+    chan->recv_head = head + nr;
+    *cmd_out = cmd & LRPC_CMD_MASK;
+    store_release(chan->recv_head_wb, chan->recv_head);
+    return len;
+}
+
+/**
+ * lrpc_line_empty - returns true if the channel has no available messages
+ * @chan: the ingress channel
+ */
+static inline bool lrpc_line_empty(struct lrpc_line_chan_in *chan)
+{
+    struct lrpc_line *m = &chan->tbl[chan->recv_head & (chan->size - 1)];
+    return (ACCESS_ONCE(m->cmd) & LRPC_DONE_PARITY) !=
+           lrpc_line_parity(chan->recv_head, chan->size);
+}
+
+extern int lrpc_line_init_out(struct lrpc_line_chan_out *chan,
+                  struct lrpc_line *tbl, unsigned int size,
+                  uint32_t *recv_head_wb);
+extern int lrpc_line_init_in(struct lrpc_line_chan_in *chan,
+                 struct lrpc_line *tbl, unsigned int size,
+                 uint32_t *recv_head_wb);
+
 #ifdef __cplusplus
 }
 #endif
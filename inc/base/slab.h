@@ -6,6 +6,7 @@
 
 #include <base/stddef.h>
 #include <base/list.h>
+#include <base/atomic.h>
 #include <base/thread.h>
 #include <base/limits.h>
 
@@ -28,7 +29,11 @@ struct tcache;
 /* function attributes for methods that allocate slab items */
 #define __slab_malloc       __malloc __assume_aligned(SLAB_MIN_SIZE)
 
-/* Slab nodes are per-numa node slab internal state. */
+/*
+ * Slab nodes are per-numa node slab internal state. Scalable slabs also keep
+ * a slab node per thread, which only its owner touches (no page_lock); other
+ * threads hand items back through @remote_free.
+ */
 struct slab_node {
     size_t         size;
     int            numa_node;
@@ -43,6 +48,9 @@ struct slab_node {
     struct list_head full_list;
     struct list_head partial_list;
     int              nr_pages;
+
+    /* items freed by other threads (per-thread slab nodes only) */
+    atomic64_t       remote_free __aligned(CACHE_LINE_SIZE);
 };
 
 struct slab {
@@ -50,6 +58,7 @@ struct slab {
     size_t            size;
     struct list_node  link;
     struct slab_node  *nodes[NNUMA];
+    struct slab_node  **locals; /* per-thread nodes (NULL if not scalable) */
 } __aligned(CACHE_LINE_SIZE);
 
 /* force the slab to be backed with large pages */
@@ -58,6 +67,10 @@ struct slab {
 #define SLAB_FLAG_FALSE_OKAY    BIT(1)
 /* managing 4kb pages (internal use only) */
 #define SLAB_FLAG_PAGES         BIT(2)
+/* give each thread its own slab pages, so allocation doesn't take a lock */
+#define SLAB_FLAG_SCALABLE      BIT(3)
+/* a per-thread slab node (internal use only) */
+#define SLAB_FLAG_LOCAL         BIT(4)
 
 extern int slab_create(struct slab *s, const char *name, size_t size, int flags);
 extern void slab_destroy(struct slab *s);
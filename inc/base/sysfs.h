@@ -14,6 +14,7 @@ extern "C" {
 #define SYSFS_CPU_CACHE_PATH      "/sys/devices/system/cpu/cpu%d/cache/index%d"
 #define SYSFS_NODE_PATH           "/sys/devices/system/node/node%d"
 
+extern int parse_bitlist(const char *str, unsigned long *bits, int nbits);
 extern int sysfs_parse_val(const char *path, uint64_t *val_out);
 extern int sysfs_parse_bitlist(const char *path, unsigned long *bits,
                    int nbits);
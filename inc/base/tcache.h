@@ -16,6 +16,13 @@ extern "C" {
 #define TCACHE_MAX_MAG_SIZE       64
 #define TCACHE_DEFAULT_MAG_SIZE    8
 
+/* magazine sizes double under contention, starting from the initial size */
+#define TCACHE_NR_MAG_CLASSES      7
+/* the number of depot shards that full magazines are returned to */
+#define TCACHE_NR_DEPOTS           8
+/* grow the magazine size after this many contended depot accesses */
+#define TCACHE_CONTENTION_THRESH   32
+
 struct tcache;
 
 struct tcache_hdr {
@@ -36,19 +43,35 @@ struct tcache_perthread {
     unsigned int        capacity;
     struct tcache_hdr   *loaded;
     struct tcache_hdr   *previous;
+    unsigned int        prev_capacity;
+    unsigned int        depot;
 };
 
+/* a shard of the shared pool of full magazines */
+struct tcache_depot {
+    spinlock_t               lock;
+    unsigned int             nr_mags;
+    struct tcache_hdr        *mags[TCACHE_NR_MAG_CLASSES];
+
+    /* statistics (protected by @lock) */
+    unsigned long            hits;
+    unsigned long            steals;
+    unsigned long            contended;
+} __aligned(CACHE_LINE_SIZE);
+
 struct tcache {
     const char               *name;
     const struct tcache_ops  *ops;
     size_t                   item_size;
-    atomic64_t               mags_allocated;
+    atomic64_t               items_allocated;
     struct list_node         link;
 
+    unsigned int             base_mag_size;
     unsigned int             mag_size;
-    spinlock_t               lock;
-    struct tcache_hdr        *shared_mags;
+    atomic_t                 next_depot;
     unsigned long            data;
+
+    struct tcache_depot      depots[TCACHE_NR_DEPOTS];
 };
 
 extern void *__tcache_alloc(struct tcache_perthread *ltc);
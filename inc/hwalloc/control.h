@@ -6,6 +6,7 @@
 
 #include <sys/types.h>
 
+#include <base/atomic.h>
 #include <base/limits.h>
 #include <hwalloc/shm.h>
 
@@ -17,8 +18,25 @@ struct q_ptrs {
     uint32_t rxq_wb; /* must be first */
     uint32_t rq_head;
     uint32_t rq_tail;
+    /* TSC when the oldest runnable thread was queued, 0 if none */
+    uint64_t oldest_tsc;
+    /* futex the kthread parks on (CONTROL_FLAG_PARK_FUTEX) */
+    atomic_t park_word;
+    /* requests for the kthread to yield (PREEMPT_FLAG_*) */
+    uint32_t preempt_flag;
 };
 
+/* preempt_flag bits */
+#define PREEMPT_FLAG_CORE   BIT(0) /* hwallocd wants the core back */
+#define PREEMPT_FLAG_YIELD  BIT(1) /* the running uthread's time slice ended */
+
+/*
+ * park_word values. hwallocd wakes a kthread by storing its assigned core + 1,
+ * and only issues FUTEX_WAKE if the kthread stopped spinning and went to sleep.
+ */
+#define PARK_WORD_PARKED    0
+#define PARK_WORD_SLEEPING  (-1)
+
 /* describes a runtime kernel thread */
 struct thread_spec {
     struct queue_spec   rxq;
@@ -32,6 +50,15 @@ enum {
     SCHED_PRIORITY_SYSTEM = 0, /* high priority, system-level services */
     SCHED_PRIORITY_NORMAL,     /* normal priority, typical tasks */
     SCHED_PRIORITY_BATCH,      /* low priority, batch processing */
+    SCHED_PRIORITY_NR,         /* number of priority classes */
+};
+
+/* policies the hwallocd can use to decide when a runtime needs a core */
+enum {
+    CORE_POLICY_CONGESTION = 0, /* a queue didn't drain since the last poll */
+    CORE_POLICY_DELAY,          /* queueing delay exceeds a target */
+    CORE_POLICY_UTIL,           /* most kthreads have queued work on average */
+    CORE_POLICY_NR,             /* number of policies */
 };
 
 /* describes scheduler options */
@@ -41,14 +68,19 @@ struct sched_spec {
     unsigned int        guaranteed_cores;
     unsigned int        congestion_latency_us;
     unsigned int        scaleout_latency_us;
+    unsigned int        core_policy;
 };
 
 #define CONTROL_HDR_MAGIC    0x696f6b3a /* "iok:" */
 
+/* control header flags */
+#define CONTROL_FLAG_PARK_FUTEX  BIT(0) /* wake kthreads via park_word */
+
 /* the main control header */
 struct control_hdr {
     unsigned int        magic;
     unsigned int        thread_count;
+    unsigned int        flags;
     struct sched_spec   sched_cfg;
     struct thread_spec  threads[1];
     /* avoid flexible array member, but same memory layout, as long as the shm
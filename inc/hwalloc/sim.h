@@ -0,0 +1,15 @@
+/*
+ * sim.h - an in-process hwallocd for tests and benchmarks
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int hwalloc_sim_start(int nargs, char *args[]);
+
+#ifdef __cplusplus
+}
+#endif
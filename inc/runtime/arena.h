@@ -0,0 +1,30 @@
+/*
+ * arena.h - uthread-scoped temporary allocations
+ */
+
+#pragma once
+
+#include <base/stddef.h>
+#include <base/mem.h>
+
+/* the largest single allocation an arena can satisfy */
+#define UT_ARENA_MAX_ALLOC    (PGSIZE_4KB - CACHE_LINE_SIZE)
+/* the default (and minimum) alignment of arena allocations */
+#define UT_ARENA_ALIGN        16
+
+extern void *ut_arena_alloc_aligned(size_t size, size_t align) __malloc;
+extern void ut_arena_reset(void);
+
+/**
+ * ut_arena_alloc - allocates temporary memory owned by the calling uthread
+ * @size: the number of bytes (at most UT_ARENA_MAX_ALLOC)
+ *
+ * The memory does not need to be freed; it is reclaimed all at once when the
+ * uthread exits or calls ut_arena_reset(). Must be called from a uthread.
+ *
+ * Returns a pointer aligned to UT_ARENA_ALIGN, or NULL if out of memory.
+ */
+static inline void *ut_arena_alloc(size_t size)
+{
+    return ut_arena_alloc_aligned(size, UT_ARENA_ALIGN);
+}
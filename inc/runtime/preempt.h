@@ -7,7 +7,9 @@
 #include <base/stddef.h>
 
 extern volatile __thread unsigned int preempt_cnt;
+extern __thread volatile uint32_t *preempt_flag;
 extern void preempt(void);
+extern void preempt_flag_raised(void);
 
 #define PREEMPT_NOT_PENDING    (1 << 31)
 
@@ -89,6 +91,23 @@ static inline void preempt_enable_nocheck(void)
 static inline void preempt_enable(void)
 {
     preempt_enable_nocheck();
+    if (unlikely(*preempt_flag))
+        preempt_flag_raised();
+    if (unlikely(preempt_cnt == 0))
+        preempt();
+}
+
+/**
+ * ut_safepoint - yields if a preemption or the end of a time slice is pending
+ *
+ * A cooperative preemption point for long computations that never enable
+ * preemption on their own. Does nothing while preemption is disabled. Code
+ * built with SAFEPOINT_CFLAGS gets one at every function entry.
+ */
+static inline void ut_safepoint(void)
+{
+    if (unlikely(*preempt_flag))
+        preempt_flag_raised();
     if (unlikely(preempt_cnt == 0))
         preempt();
 }
@@ -22,11 +22,28 @@ extern void thread_park_and_unlock_np(spinlock_t *l);
 extern void thread_ready(thread_t *thread);
 extern void thread_throw(thread_t *thread, int core);
 extern void thread_swap(thread_t *thread, int core);
+extern int kthread_post(int kidx, thread_fn_t fn, void *arg);
 extern thread_t *thread_create(thread_fn_t fn, void *arg);
+extern thread_t *thread_create_fp(thread_fn_t fn, void *arg, int fp_mode);
 extern thread_t *thread_create_with_buf(thread_fn_t fn, void **buf, size_t len);
 
 extern __thread thread_t *__self;
 
+/*
+ * Floating point state kept across switches, for thread_create_fp(). Threads
+ * that never touch it can skip saving it, which makes switching to and from
+ * them cheaper. A thread must not change rounding modes or exception masks
+ * unless it uses THREAD_FP_FULL, the default.
+ */
+enum {
+    /* integer-only code, same as THREAD_FP_VEC on aarch64 */
+    THREAD_FP_NONE = 0,
+    /* callee-saved vector registers (d8-d15 on aarch64, none on x86_64) */
+    THREAD_FP_VEC,
+    /* the above plus the control state (MXCSR and x87 CW, or FPCR) */
+    THREAD_FP_FULL,
+};
+
 /**
  * thread_self - gets the currently running thread
  */
@@ -32,6 +32,7 @@
 #include "hwalloc/queue.h"
 #include "hwalloc/shm.h"
 
+#include "runtime/arena.h"
 #include "runtime/preempt.h"
 #include "runtime/sync.h"
 #include "runtime/thread.h"
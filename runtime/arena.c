@@ -0,0 +1,103 @@
+/*
+ * arena.c - a bump allocator for uthread-scoped temporary allocations
+ *
+ * Each uthread owns a chain of 4KB pages taken from the local kthread's small
+ * page cache. Allocations are carved out of the newest page with a bump
+ * pointer and are never freed individually; the whole chain is handed back to
+ * the page cache when the uthread exits or resets its arena. Since recycled
+ * pages land in the per-kthread tcache, short-lived uthreads on the same
+ * kthread keep reusing the same warm pages.
+ */
+
+#include <base/stddef.h>
+#include <base/page.h>
+#include <runtime/arena.h>
+
+#include "defs.h"
+
+/* sits at the start of every arena page */
+struct arena_page {
+    struct arena_page    *next;
+};
+
+BUILD_ASSERT(sizeof(struct arena_page) <= PGSIZE_4KB - UT_ARENA_MAX_ALLOC);
+
+static bool arena_grow(thread_t *th)
+{
+    struct arena_page *pg;
+
+    /* the page cache is per-kthread, so stay put while using it */
+    preempt_disable();
+    pg = page_alloc_addr(PGSIZE_4KB);
+    preempt_enable();
+    if (unlikely(!pg))
+        return false;
+
+    pg->next = th->arena_pages;
+    th->arena_pages = pg;
+    th->arena_pos = (uintptr_t)pg + PGSIZE_4KB - UT_ARENA_MAX_ALLOC;
+    th->arena_end = (uintptr_t)pg + PGSIZE_4KB;
+    return true;
+}
+
+/**
+ * ut_arena_alloc_aligned - allocates aligned temporary memory owned by the
+ * calling uthread
+ * @size: the number of bytes (at most UT_ARENA_MAX_ALLOC)
+ * @align: the alignment (a power of 2, at most CACHE_LINE_SIZE)
+ *
+ * Returns a pointer, or NULL if the request is too large or out of memory.
+ */
+void *ut_arena_alloc_aligned(size_t size, size_t align)
+{
+    thread_t *th = thread_self();
+    uintptr_t pos;
+
+    assert(is_power_of_two(align));
+    if (unlikely(size > UT_ARENA_MAX_ALLOC || align > CACHE_LINE_SIZE))
+        return NULL;
+    if (align < UT_ARENA_ALIGN)
+        align = UT_ARENA_ALIGN;
+
+    pos = align_up(th->arena_pos, align);
+    if (unlikely(pos + size > th->arena_end)) {
+        if (unlikely(!arena_grow(th)))
+            return NULL;
+        /* a fresh page is cache-line aligned past its header */
+        pos = th->arena_pos;
+    }
+
+    th->arena_pos = pos + size;
+    return (void *)pos;
+}
+
+/**
+ * arena_release - returns all of a uthread's arena pages to the page cache
+ * @th: the uthread
+ *
+ * Preemption must be disabled.
+ */
+void arena_release(thread_t *th)
+{
+    struct arena_page *pg, *next;
+
+    assert_preempt_disabled();
+
+    for (pg = th->arena_pages; pg; pg = next) {
+        next = pg->next;
+        page_put_addr(pg);
+    }
+
+    th->arena_pages = NULL;
+    th->arena_pos = th->arena_end = 0;
+}
+
+/**
+ * ut_arena_reset - frees every arena allocation made by the calling uthread
+ */
+void ut_arena_reset(void)
+{
+    preempt_disable();
+    arena_release(thread_self());
+    preempt_enable();
+}
@@ -11,6 +11,7 @@
 #include <base/bitmap.h>
 #include <base/log.h>
 #include <base/cpu.h>
+#include <base/sysfs.h>
 
 #include "defs.h"
 
@@ -89,6 +90,200 @@ static int parse_runtime_guaranteed_kthreads(const char *name, const char *val)
     return 0;
 }
 
+static int parse_runtime_priority(const char *name, const char *val)
+{
+    static const char *names[SCHED_PRIORITY_NR] = {
+        [SCHED_PRIORITY_SYSTEM] = "system",
+        [SCHED_PRIORITY_NORMAL] = "normal",
+        [SCHED_PRIORITY_BATCH] = "batch",
+    };
+    int i;
+
+    for (i = 0; val && i < SCHED_PRIORITY_NR; i++) {
+        if (!strcmp(val, names[i])) {
+            cfg_priority = i;
+            return 0;
+        }
+    }
+
+    log_err("invalid priority '%s', must be system, normal or batch", val);
+    return -EINVAL;
+}
+
+static int parse_runtime_core_policy(const char *name, const char *val)
+{
+    static const char *names[CORE_POLICY_NR] = {
+        [CORE_POLICY_CONGESTION] = "congestion",
+        [CORE_POLICY_DELAY] = "delay",
+        [CORE_POLICY_UTIL] = "util",
+    };
+    int i;
+
+    for (i = 0; val && i < CORE_POLICY_NR; i++) {
+        if (!strcmp(val, names[i])) {
+            cfg_core_policy = i;
+            return 0;
+        }
+    }
+
+    log_err("invalid core policy '%s', must be congestion, delay or util",
+            val);
+    return -EINVAL;
+}
+
+static int parse_latency_us(const char *name, const char *val,
+                            unsigned int *out)
+{
+    long tmp;
+    int ret;
+
+    ret = str_to_long(val, &tmp);
+    if (ret)
+        return ret;
+
+    if (tmp < 0 || tmp > UINT_MAX) {
+        log_err("invalid %s '%ld'", name, tmp);
+        return -EINVAL;
+    }
+
+    *out = tmp;
+    return 0;
+}
+
+static int parse_runtime_congestion_latency_us(const char *name,
+                                               const char *val)
+{
+    return parse_latency_us(name, val, &cfg_congestion_latency_us);
+}
+
+static int parse_runtime_scaleout_latency_us(const char *name,
+                                             const char *val)
+{
+    return parse_latency_us(name, val, &cfg_scaleout_latency_us);
+}
+
+static int parse_runtime_stack_commit_kb(const char *name, const char *val)
+{
+    long tmp;
+    int ret;
+
+    ret = str_to_long(val, &tmp);
+    if (ret)
+        return ret;
+
+    if (tmp < RUNTIME_STACK_GROW_SIZE / KB ||
+        tmp >= (RUNTIME_STACK_SIZE) / KB || tmp % (PGSIZE_4KB / KB)) {
+        log_err("invalid stack commit size requested, '%ld KB'", tmp);
+        log_err("must be a multiple of %d KB in [%d, %d)", PGSIZE_4KB / KB,
+                RUNTIME_STACK_GROW_SIZE / KB, (RUNTIME_STACK_SIZE) / KB);
+        return -EINVAL;
+    }
+
+    stack_commit_size = tmp * KB;
+    return 0;
+}
+
+static int parse_runtime_stack_max_kb(const char *name, const char *val)
+{
+    long tmp;
+    int ret;
+
+    ret = str_to_long(val, &tmp);
+    if (ret)
+        return ret;
+
+    if (tmp <= 0 || tmp > (RUNTIME_STACK_SIZE) / KB ||
+        tmp % (PGSIZE_4KB / KB)) {
+        log_err("invalid max stack size requested, '%ld KB'", tmp);
+        log_err("must be a multiple of %d KB and <= %d KB", PGSIZE_4KB / KB,
+                (RUNTIME_STACK_SIZE) / KB);
+        return -EINVAL;
+    }
+
+    stack_max_size = tmp * KB;
+    return 0;
+}
+
+static int parse_runtime_stack_hugepage_flag(const char *name,
+                                             const char *val)
+{
+    stack_hugepage = true;
+    return 0;
+}
+
+static int parse_runtime_park_futex_flag(const char *name, const char *val)
+{
+    park_futex = true;
+    return 0;
+}
+
+static int parse_runtime_park_spin_us(const char *name, const char *val)
+{
+    long tmp;
+    int ret;
+
+    ret = str_to_long(val, &tmp);
+    if (ret)
+        return ret;
+
+    if (tmp < 0 || tmp > ONE_MS) {
+        log_err("invalid park spin time '%ld us', must be in [0, %d]",
+                tmp, ONE_MS);
+        return -EINVAL;
+    }
+
+    park_spin_us = tmp;
+    return 0;
+}
+
+static int parse_runtime_dedicated_cores(const char *name, const char *val)
+{
+    int ret;
+
+    if (!val)
+        return -EINVAL;
+
+    ret = parse_bitlist(val, dedicated_cores, cpu_count);
+    if (ret) {
+        log_err("invalid dedicated core list '%s'", val);
+        return ret;
+    }
+
+    dedicated_mode = true;
+    return 0;
+}
+
+static int parse_runtime_quantum_us(const char *name, const char *val)
+{
+    long tmp;
+    int ret;
+
+    if (val && !strcmp(val, "auto")) {
+        quantum_auto = true;
+        return 0;
+    }
+
+    ret = str_to_long(val, &tmp);
+    if (ret)
+        return ret;
+
+    if (tmp < 0 || tmp > ONE_SECOND) {
+        log_err("invalid quantum '%ld us', must be in [0, %d]",
+                tmp, ONE_SECOND);
+        return -EINVAL;
+    }
+
+    quantum_us = tmp;
+    return 0;
+}
+
+static int parse_runtime_quantum_cooperative_flag(const char *name,
+                                                  const char *val)
+{
+    quantum_cooperative = true;
+    return 0;
+}
+
 static int parse_watchdog_flag(const char *name, const char *val)
 {
     disable_watchdog = true;
@@ -132,6 +327,21 @@ static const struct cfg_handler cfg_handlers[] = {
     { "runtime_spinning_kthreads", parse_runtime_spinning_kthreads, false },
     { "runtime_guaranteed_kthreads", parse_runtime_guaranteed_kthreads,
             false },
+    { "runtime_priority", parse_runtime_priority, false },
+    { "runtime_core_policy", parse_runtime_core_policy, false },
+    { "runtime_congestion_latency_us", parse_runtime_congestion_latency_us,
+            false },
+    { "runtime_scaleout_latency_us", parse_runtime_scaleout_latency_us,
+            false },
+    { "runtime_stack_commit_kb", parse_runtime_stack_commit_kb, false },
+    { "runtime_stack_max_kb", parse_runtime_stack_max_kb, false },
+    { "runtime_stack_hugepage", parse_runtime_stack_hugepage_flag, false },
+    { "runtime_park_futex", parse_runtime_park_futex_flag, false },
+    { "runtime_park_spin_us", parse_runtime_park_spin_us, false },
+    { "runtime_dedicated_cores", parse_runtime_dedicated_cores, false },
+    { "runtime_quantum_us", parse_runtime_quantum_us, false },
+    { "runtime_quantum_cooperative", parse_runtime_quantum_cooperative_flag,
+            false },
     { "log_level", parse_log_level, false },
     { "disable_watchdog", parse_watchdog_flag, false },
 };
@@ -168,7 +378,8 @@ int cfg_load(const char *path)
         name = strtok(buf, " ");
         if (!name)
             break;
-        val = strtok(NULL, " ");
+        /* values are passed without the trailing newline */
+        val = strtok(NULL, " \n");
 
         for (i = 0; i < ARRAY_SIZE(cfg_handlers); i++) {
             const struct cfg_handler *h = &cfg_handlers[i];
@@ -204,6 +415,33 @@ int cfg_load(const char *path)
         goto out;
     }
 
+    if (dedicated_mode) {
+        int core, ncores = 0;
+
+        bitmap_for_each_set(dedicated_cores, cpu_count, core)
+            ncores++;
+        if (ncores < maxks) {
+            log_err("dedicated mode needs a core per kthread, only %d "
+                    "cores given for %d kthreads", ncores, maxks);
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    if (stack_commit_size > stack_max_size) {
+        log_err("invalid stack commit size requested, '%ld KB'",
+                stack_commit_size / KB);
+        log_err("must be <= %ld KB (max stack size)", stack_max_size / KB);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (stack_hugepage && stack_commit_size) {
+        log_err("growable stacks are not supported with huge page stacks");
+        ret = -EINVAL;
+        goto out;
+    }
+
 out:
     fclose(f);
     return ret;
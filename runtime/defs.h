@@ -5,6 +5,7 @@
 #pragma once
 
 #include <base/stddef.h>
+#include <base/bitmap.h>
 #include <base/list.h>
 #include <base/mem.h>
 #include <base/tcache.h>
@@ -26,8 +27,12 @@
 #define RUNTIME_MAX_THREADS       100000
 #define RUNTIME_STACK_SIZE        128 * KB
 #define RUNTIME_GUARD_SIZE        128 * KB
+#define RUNTIME_STACK_GROW_SIZE   16 * KB
+#define RUNTIME_ALTSTACK_SIZE     64 * KB
+#define RUNTIME_STACK_ARENA_SIZE  PGSIZE_2MB
 #define RUNTIME_RQ_SIZE           32
 #define RUNTIME_RRQ_SIZE          7
+#define RUNTIME_MESH_SIZE         16
 #define RUNTIME_SOFTIRQ_BUDGET    16
 #define RUNTIME_MAX_TIMERS        4096
 #define RUNTIME_MAX_SIBLINGS      7
@@ -36,12 +41,30 @@
 #define RUNTIME_SCHED_POLL_MAX    4
 #define RUNTIME_SCHED_MIN_POLL_US 2
 #define RUNTIME_WATCHDOG_US       50
+#define RUNTIME_PARK_SPIN_US      2
+/* time slices picked by "runtime_quantum_us auto" for each priority class */
+#define RUNTIME_QUANTUM_SYSTEM_US 50
+#define RUNTIME_QUANTUM_NORMAL_US 500
+#define RUNTIME_QUANTUM_BATCH_US  5000
+/* delivers quantum ticks, ignored by default and rarely used otherwise */
+#define RUNTIME_QUANTUM_SIGNAL    SIGURG
 
 
 /*
  * Trap frame support
  */
 
+/*
+ * Every switch happens at a function call: __jmp_thread_direct() and
+ * __jmp_runtime() are called like any other function, and preemption calls
+ * thread_yield() from the signal handler, after the kernel has saved the full
+ * interrupted context on the signal stack. A frame therefore only holds what
+ * the calling convention requires a callee to preserve, plus the first
+ * argument for threads that haven't started yet. Both layouts list the same
+ * things in the same order: argument, callee-saved registers, instruction
+ * and stack pointers, floating point control state.
+ */
+
 #if defined(__x86_64__)
 /*
  * See the "System V Application Binary Interface" for a full explation of
@@ -49,15 +72,8 @@
  */
 
 struct thread_tf {
-    /* argument registers, can be clobbered by callee */
-    uint64_t rdi; /* first argument */
-    uint64_t rsi;
-    uint64_t rdx;
-    uint64_t rcx;
-    uint64_t r8;
-    uint64_t r9;
-    uint64_t r10;
-    uint64_t r11;
+    /* first argument, only used to start new threads */
+    uint64_t rdi;
 
     /* callee-saved registers */
     uint64_t rbx;
@@ -68,54 +84,42 @@ struct thread_tf {
     uint64_t r15;
 
     /* special-purpose registers */
-    uint64_t rax;    /* holds return value */
     uint64_t rip;    /* instruction pointer */
     uint64_t rsp;    /* stack pointer */
+
+    /* floating point control words, also callee-saved */
+    uint32_t mxcsr;  /* SSE control and status */
+    uint16_t fpucw;  /* x87 control word */
+    uint16_t pad;
 };
 
+/* control words a new process starts with */
+#define MXCSR_INIT      0x1f80
+#define FPUCW_INIT      0x037f
+
 #define SPTR(tf)        ((tf)->rsp)
 #define IPTR(tf)        ((tf)->rip)
 #define BPTR(tf)        ((tf)->rbp)
 #define ARG0(tf)        ((tf)->rdi)
-#define ARG1(tf)        ((tf)->rsi)
-#define ARG2(tf)        ((tf)->rdx)
-#define ARG3(tf)        ((tf)->rcx)
-#define ARG4(tf)        ((tf)->r8)
-#define ARG5(tf)        ((tf)->r9)
+#define FP_INIT(tf)                 \
+    do {                            \
+        (tf)->mxcsr = MXCSR_INIT;   \
+        (tf)->fpucw = FPUCW_INIT;   \
+    } while (0)
+
+/* must match the offsets in switch.S */
+BUILD_ASSERT(offsetof(struct thread_tf, rsp) == 64);
+BUILD_ASSERT(offsetof(struct thread_tf, fpucw) == 76);
 
 #elif defined(__aarch64__)
+/*
+ * See the "Procedure Call Standard for the Arm 64-bit Architecture" for a full
+ * explanation of calling and argument passing conventions.
+ */
 
 struct thread_tf {
-    /* argument registers, can be clobbered by callee */
-    uint64_t r0; /* first argument */
-    /* no space needed for r1-r18, which are clobbered
-    uint64_t r1;
-    uint64_t r2;
-    uint64_t r3;
-    uint64_t r4;
-    uint64_t r5;
-    uint64_t r6;
-    uint64_t r7;
-    */
-
-    /* special register */
-    /*uint64_t r8; */    /* indirect result location register */
-
-    /* temporary registers */
-    /*
-    uint64_t r9;
-    uint64_t r10;
-    uint64_t r11;
-    uint64_t r12;
-    uint64_t r13;
-    uint64_t r14;
-    uint64_t r15;
-    */
-
-    /* special registers */
-    /*uint64_t r16;*/    /* IP0 first intra-procedure-call scratch register */
-    /*uint64_t r17;*/    /* IP1 second intra-procedure-call scratch register */
-    /*uint64_t r18;*/    /* platform register */
+    /* first argument, only used to start new threads */
+    uint64_t r0;
 
     /* callee-saved registers */
     uint64_t r19;
@@ -135,9 +139,12 @@ struct thread_tf {
     uint64_t pc;    /* IP the frame pointer */
     uint64_t sp;    /* sP the stack pointer */
 
+    /* floating point control register, also callee-saved */
+    uint64_t fpcr;
+
 #if defined(__ARM_NEON)
-    /* SIMD&FP registers */
-    uint64_t v8_v15[16];
+    /* callee-saved SIMD&FP registers, only the low 64 bits of v8-v15 */
+    uint64_t d8_d15[8];
 #endif
 };
 
@@ -146,6 +153,10 @@ struct thread_tf {
 #define BPTR(tf)        ((tf)->r29)
 #define LPTR(tf)        ((tf)->r30)
 #define ARG0(tf)        ((tf)->r0)
+#define FP_INIT(tf)     ((tf)->fpcr = 0)
+
+/* must match the offsets in switch.S */
+BUILD_ASSERT(offsetof(struct thread_tf, fpcr) == 120);
 
 #endif
 
@@ -170,17 +181,36 @@ struct libut_thread {
     unsigned int        state;
     unsigned int        stack_busy;
     int                 kthread_wanted;
+    int                 fp_mode; /* THREAD_FP_* */
+    /* TSC when last made runnable, for reporting queueing delay */
+    uint64_t            ready_tsc;
+    /* uthread-scoped arena (see arena.c) */
+    void                *arena_pages;
+    uintptr_t           arena_pos;
+    uintptr_t           arena_end;
 };
 
 typedef void (*runtime_fn_t)(void);
 
-/* assembly helper routines from switch.S */
+/* assembly helper routines from switch.S, with variants per THREAD_FP_* */
 extern void __jmp_thread(struct thread_tf *tf) __noreturn;
+extern void __jmp_thread_vec(struct thread_tf *tf) __noreturn;
+extern void __jmp_thread_nofp(struct thread_tf *tf) __noreturn;
 extern void __jmp_thread_direct(struct thread_tf *oldtf,
                 struct thread_tf *newtf,
                 unsigned int *stack_busy);
+extern void __jmp_thread_direct_vec(struct thread_tf *oldtf,
+                struct thread_tf *newtf,
+                unsigned int *stack_busy);
+extern void __jmp_thread_direct_nofp(struct thread_tf *oldtf,
+                struct thread_tf *newtf,
+                unsigned int *stack_busy);
 extern void __jmp_runtime(struct thread_tf *tf, runtime_fn_t fn,
               void *stack);
+extern void __jmp_runtime_vec(struct thread_tf *tf, runtime_fn_t fn,
+              void *stack);
+extern void __jmp_runtime_nofp(struct thread_tf *tf, runtime_fn_t fn,
+              void *stack);
 extern void __jmp_runtime_nosave(runtime_fn_t fn, void *stack) __noreturn;
 
 
@@ -198,6 +228,15 @@ struct stack {
 
 extern __thread struct tcache_perthread __perthread_stack_pt;
 
+/* bytes committed at the top of a new stack (0 if stacks are not growable) */
+extern size_t stack_commit_size;
+/* the maximum number of bytes a growable stack can extend to */
+extern size_t stack_max_size;
+/* carve unguarded stacks out of huge page arenas */
+extern bool stack_hugepage;
+
+extern int stack_commit(struct stack *s, size_t len);
+
 /**
  * stack_alloc - allocates a stack
  *
@@ -292,6 +331,12 @@ stack_init_to_rsp_with_buf(struct stack *s, void **buf, size_t buf_len,
     return rsp;
 }
 
+/*
+ * Arena support
+ */
+
+extern void arena_release(thread_t *th);
+
 /*
  * ioqueues
  */
@@ -352,7 +397,15 @@ struct kthread {
     spinlock_t             timer_lock;
     unsigned int           timern;
     struct timer_idx       *timers;
-    unsigned long          pad2[6];
+    struct lrpc_chan_in    *mesh_in;
+    struct lrpc_chan_out   *mesh_out;
+    /* set while another kthread is queued to drain our rings for us */
+    unsigned int           mesh_rescue;
+    unsigned int           pad2[7];
+
+    /* 10th cache-line */
+    DEFINE_BITMAP(mesh_pending, NCPU);
+    unsigned long          pad3[4];
 };
 
 /* compile-time verification of cache-line alignment */
@@ -362,6 +415,7 @@ BUILD_ASSERT(offsetof(struct kthread, q_ptrs) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, rq) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, rrq) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, timer_lock) % CACHE_LINE_SIZE == 0);
+BUILD_ASSERT(offsetof(struct kthread, mesh_pending) % CACHE_LINE_SIZE == 0);
 
 extern __thread struct kthread *mykthread;
 
@@ -397,14 +451,28 @@ DECLARE_SPINLOCK(klock);
 extern unsigned int maxks;
 extern unsigned int spinks;
 extern unsigned int guaranteedks;
+extern unsigned int cfg_priority;
+extern unsigned int cfg_core_policy;
+extern unsigned int cfg_congestion_latency_us;
+extern unsigned int cfg_scaleout_latency_us;
 extern unsigned int nrks;
 extern struct kthread *ks[NCPU];
 extern struct kthread *allks[NCPU];
 extern pthread_t ktids[NCPU];
 
+extern bool park_futex;
+extern unsigned int park_spin_us;
+extern bool dedicated_mode;
+extern unsigned int quantum_us;
+extern bool quantum_auto;
+extern bool quantum_cooperative;
+extern __thread thread_t *quantum_thread;
+extern unsigned long dedicated_cores[BITMAP_LONG_SIZE(NCPU)];
+
 extern void kthread_detach(struct kthread *r);
 extern void kthread_park(bool voluntary);
 extern void kthread_wait_to_attach(void);
+extern void kthread_wake_idle(void);
 
 struct cpu_record {
     struct kthread *recent_kthread;
@@ -430,6 +498,21 @@ extern thread_t *softirq_run_thread(struct kthread *k, unsigned int budget);
 extern void softirq_run(unsigned int budget);
 
 
+/*
+ * Kthread mesh support (see mesh.c)
+ */
+
+/* an SPSC ring carrying closures from one kthread to another */
+struct mesh_ring {
+    struct lrpc_msg        tbl[RUNTIME_MESH_SIZE];
+    uint32_t               recv_head_wb __aligned(CACHE_LINE_SIZE);
+} __aligned(CACHE_LINE_SIZE);
+
+extern bool mesh_ready(struct kthread *k);
+extern unsigned int mesh_recv(struct kthread *k, struct lrpc_msg *msgs,
+                              unsigned int budget);
+
+
 /*
  * Network stack
  */
@@ -480,13 +563,16 @@ extern int stack_init(void);
 extern int sched_init(void);
 extern int preempt_init(void);
 extern int trans_init(void);
+extern int mesh_init(void);
 
 /* per-thread initialization */
 extern int kthread_init_thread(void);
 extern int ioqueues_init_thread(void);
 extern int stack_init_thread(void);
 extern int timer_init_thread(void);
+extern int preempt_init_thread(void);
 extern int sched_init_thread(void);
+extern int mesh_init_thread(void);
 
 /* per-thread finialization */
 extern int timer_fini_thread(void);
@@ -25,6 +25,7 @@ static const struct init_handler global_init_handlers[] = {
     BASE_INITIALIZER(stack),    /* create stack_tcache */
     BASE_INITIALIZER(sched),    /* create thread_tcache */
     BASE_INITIALIZER(preempt),  /* register handler for SIGUSR1 */
+    BASE_INITIALIZER(mesh),     /* allocate the kthread mesh rings */
 };
 
 /* per-kthread subsystem initialization */
@@ -35,6 +36,8 @@ static const struct init_handler thread_init_handlers[] = {
     THREAD_INITIALIZER(stack),    /* init perthread stack tcache */
     THREAD_INITIALIZER(timer),    /* allocate cacheline timer structure */
     THREAD_INITIALIZER(sched),    /* set perthread thread tcache, init rsp */
+    THREAD_INITIALIZER(mesh),     /* attach to the kthread mesh rings */
+    THREAD_INITIALIZER(preempt),  /* start the quantum timer, if enabled */
 };
 
 static const struct init_handler late_init_handlers[] = {
@@ -154,6 +157,10 @@ int runtime_initialize(const char *cfgpath)
     /* make sure all threads done runtime_init_thread() */
     pthread_barrier_wait(&init_barrier);
 
+    /* dedicated kthreads schedule their own cores */
+    if (dedicated_mode)
+        return 0;
+
     /* establish connection (tids, park_efds, rxq/txq) with hwallocd */
     ret = ioqueues_register_hwallocd();
     if (ret) {
@@ -29,6 +29,13 @@ unsigned int nrqs = 0;
 
 struct hwallocd_control hwc;
 
+/* the class the hwallocd preempts cores by, and how it decides when to
+ * grant this runtime more cores */
+unsigned int cfg_priority = SCHED_PRIORITY_NORMAL;
+unsigned int cfg_core_policy = CORE_POLICY_CONGESTION;
+unsigned int cfg_congestion_latency_us;
+unsigned int cfg_scaleout_latency_us;
+
 static int generate_random_key(mem_key_t *key)
 {
     int fd, ret;
@@ -106,15 +113,25 @@ static int ioqueues_shm_setup(unsigned int threads)
     int i, ret;
     size_t shm_len;
 
-    ret = generate_random_key(&hwc.key);
-    if (ret < 0)
-        return ret;
-    hwc.key = rand_crc32c(hwc.key);
-
     /* map shared memory for control header, command queues */
     shm_len = calculate_shm_space(threads);
     r->len = shm_len;
-    r->base = mem_map_shm(hwc.key, NULL, shm_len, PGSIZE_2MB, true);
+    if (dedicated_mode) {
+        /* nobody else maps the queues, so private memory will do */
+        r->base = mem_map_anom(NULL, shm_len, PGSIZE_4KB, 0);
+    } else {
+        ret = generate_random_key(&hwc.key);
+        if (ret < 0)
+            return ret;
+        hwc.key = rand_crc32c(hwc.key);
+
+        r->base = mem_map_shm(hwc.key, NULL, shm_len, PGSIZE_2MB, true);
+        if (r->base == MAP_FAILED) {
+            /* no huge pages reserved, e.g. an unprivileged test run */
+            log_warn("control_setup: no 2MB pages, using 4KB pages");
+            r->base = mem_map_shm(hwc.key, NULL, shm_len, PGSIZE_4KB, true);
+        }
+    }
     if (r->base == MAP_FAILED) {
         log_err("control_setup: mem_map_shm() failed");
         return -1;
@@ -190,12 +207,14 @@ int ioqueues_register_hwallocd(void)
     hdr = r->base;
     hdr->magic = CONTROL_HDR_MAGIC;
     hdr->thread_count = hwc.thread_count;
+    hdr->flags = park_futex ? CONTROL_FLAG_PARK_FUTEX : 0;
 
-    hdr->sched_cfg.priority = SCHED_PRIORITY_NORMAL;
+    hdr->sched_cfg.priority = cfg_priority;
     hdr->sched_cfg.max_cores = hwc.thread_count;
     hdr->sched_cfg.guaranteed_cores = guaranteedks;
-    hdr->sched_cfg.congestion_latency_us = 0;
-    hdr->sched_cfg.scaleout_latency_us = 0;
+    hdr->sched_cfg.congestion_latency_us = cfg_congestion_latency_us;
+    hdr->sched_cfg.scaleout_latency_us = cfg_scaleout_latency_us;
+    hdr->sched_cfg.core_policy = cfg_core_policy;
 
     memcpy(hdr->threads, hwc.threads,
             sizeof(struct thread_spec) * hwc.thread_count);
@@ -271,6 +290,7 @@ int ioqueues_init_thread(void)
     myk()->q_ptrs = (struct q_ptrs *) shmptr_to_ptr(r, ts->q_ptrs,
             sizeof(uint32_t));
     BUG_ON(!myk()->q_ptrs);
+    preempt_flag = &myk()->q_ptrs->preempt_flag;
 
     return 0;
 }
@@ -2,12 +2,17 @@
  * kthread.c - support for adding and removing kernel threads
  */
 
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <linux/futex.h>
 #include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include <base/atomic.h>
+#include <base/bitmap.h>
 #include <base/cpu.h>
 #include <base/list.h>
 #include <base/lock.h>
@@ -30,6 +35,18 @@ unsigned int spinks;
 unsigned int guaranteedks = 1;
 /* the number of active kthreads */
 static atomic_t runningks;
+/* park on a futex in shared memory instead of reading the eventfd */
+bool park_futex;
+/* how long a parking kthread polls for a wakeup before sleeping */
+unsigned int park_spin_us = RUNTIME_PARK_SPIN_US;
+/* run on our own cores without hwallocd, one kthread per core */
+bool dedicated_mode;
+/* the cores kthreads are pinned to in dedicated mode */
+DEFINE_BITMAP(dedicated_cores, NCPU);
+/* kthreads parked in dedicated mode, most recently parked last */
+static DEFINE_SPINLOCK(idle_lock);
+static struct kthread *idleks[NCPU];
+static unsigned int nr_idleks;
 /* an array of kthread IDs */
 pthread_t ktids[NCPU];
 /* an array of attached kthreads (@nrks in total) */
@@ -60,6 +77,34 @@ static struct kthread *allock(void)
     return k;
 }
 
+/*
+ * kthread_pin_dedicated - pins a kthread to its own core in dedicated mode
+ *
+ * The n-th kthread gets the n-th core of @dedicated_cores and never moves.
+ */
+static int kthread_pin_dedicated(struct kthread *k)
+{
+    cpu_set_t cpuset;
+    int core = -1, i;
+
+    for (i = 0; i <= k->allks_idx; i++) {
+        core = bitmap_find_next_set(dedicated_cores, NCPU, core + 1);
+        BUG_ON(core >= NCPU);
+    }
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(core, &cpuset);
+    if (sched_setaffinity(0, sizeof(cpuset), &cpuset)) {
+        log_err("kthread: couldn't pin kthread %d to core %d [%s]",
+                k->allks_idx, core, strerror(errno));
+        return -errno;
+    }
+
+    k->curr_cpu = core;
+    store_release(&cpu_map[core].recent_kthread, k);
+    return 0;
+}
+
 /**
  * kthread_init_thread - initializes state for the kthread
  *
@@ -79,6 +124,9 @@ int kthread_init_thread(void)
     mykthread->allks_idx = allksn - 1;
     spin_unlock_np(&klock);
 
+    if (dedicated_mode)
+        return kthread_pin_dedicated(mykthread);
+
     return 0;
 }
 
@@ -145,8 +193,8 @@ void kthread_detach(struct kthread *r)
     if (unlikely(lrpc_get_cached_length(&r->txq) > 0))
         return;
 
-    /* one last check, an RX cmd could have squeaked in */
-    if (unlikely(!lrpc_empty(&r->rxq)))
+    /* one last check, an RX cmd or a posted closure could have squeaked in */
+    if (unlikely(!lrpc_empty(&r->rxq) || mesh_ready(r)))
         return;
 
     spin_lock(&klock);
@@ -174,7 +222,157 @@ found:
 }
 
 /*
- * kthread_yield_to_iokernel - block on eventfd until iokernel wakes us up
+ * kthread_wait_park_word - spin, then sleep on the park futex until the
+ * iokernel stores the assigned core + 1
+ * @deadline_us: give up at this time, or 0 to wait indefinitely
+ *
+ * The iokernel often hands the core back right away, so a brief spin avoids
+ * both futex syscalls in that case.
+ *
+ * Returns the stored value, or PARK_WORD_PARKED if @deadline_us passed.
+ */
+static uint64_t kthread_wait_park_word(struct kthread *k, uint64_t deadline_us)
+{
+    atomic_t *word = &k->q_ptrs->park_word;
+    uint64_t start_tsc = libut_rdtsc(), now_us;
+    struct timespec ts, *tsp = NULL;
+    long ret;
+    int val;
+
+    do {
+        val = atomic_read(word);
+        if (val != PARK_WORD_PARKED)
+            goto woken;
+        cpu_relax();
+    } while (libut_rdtsc() - start_tsc < cycles_per_us * park_spin_us);
+
+    /* tell the iokernel it must issue FUTEX_WAKE */
+    val = atomic_cmpxchg_val(word, PARK_WORD_PARKED, PARK_WORD_SLEEPING);
+    if (val != PARK_WORD_PARKED)
+        goto woken;
+
+    while ((val = atomic_read(word)) == PARK_WORD_SLEEPING) {
+        if (deadline_us) {
+            now_us = microtime();
+            if (now_us >= deadline_us)
+                return PARK_WORD_PARKED;
+            ts.tv_sec = (deadline_us - now_us) / ONE_SECOND;
+            ts.tv_nsec = (deadline_us - now_us) % ONE_SECOND * 1000;
+            tsp = &ts;
+        }
+
+        ret = syscall(SYS_futex, &word->cnt, FUTEX_WAIT, PARK_WORD_SLEEPING,
+                      tsp, NULL, 0);
+        if (ret < 0 && errno == EINTR) {
+            /* preempted while yielding, yield again */
+            assert(preempt_needed());
+            clear_preempt_needed();
+        }
+    }
+
+woken:
+    return val;
+}
+
+/* leaves the idle list unless a waker already took us off */
+static void kthread_leave_idle(struct kthread *k, int park_word)
+{
+    int i;
+
+    spin_lock(&idle_lock);
+    if (atomic_cmpxchg(&k->q_ptrs->park_word, park_word, k->curr_cpu + 1)) {
+        for (i = 0; i < nr_idleks; i++) {
+            if (idleks[i] == k) {
+                idleks[i] = idleks[--nr_idleks];
+                break;
+            }
+        }
+    }
+    spin_unlock(&idle_lock);
+}
+
+/* returns true if any kthread has threads queued */
+static bool kthread_any_work(void)
+{
+    int i;
+
+    for (i = 0; i < nrks; i++) {
+        if (ACCESS_ONCE(ks[i]->rq_head) != ACCESS_ONCE(ks[i]->rq_tail))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * kthread_park_dedicated - sleep until another kthread makes a thread
+ * runnable or our earliest timer expires
+ * @deadline_us: the earliest timer deadline, or 0 if there are no timers
+ *
+ * Replaces the round trip through hwallocd in dedicated mode. The kthread
+ * keeps its core, so it always wakes up on curr_cpu.
+ */
+static void kthread_park_dedicated(struct kthread *k, uint64_t deadline_us)
+{
+    atomic_write(&k->q_ptrs->park_word, PARK_WORD_PARKED);
+
+    spin_lock(&idle_lock);
+    idleks[nr_idleks] = k;
+    store_release(&nr_idleks, nr_idleks + 1);
+    spin_unlock(&idle_lock);
+
+    /*
+     * A thread made runnable after our last steal attempt either sees us on
+     * the idle list (see kthread_wake_idle()) or we see its runqueue here.
+     */
+    mb();
+    if (unlikely(kthread_any_work())) {
+        kthread_leave_idle(k, PARK_WORD_PARKED);
+        return;
+    }
+
+    if (kthread_wait_park_word(k, deadline_us) != PARK_WORD_PARKED)
+        return;
+
+    /* timed out */
+    kthread_leave_idle(k, PARK_WORD_SLEEPING);
+}
+
+/**
+ * kthread_wake_idle - wakes a parked kthread to run newly runnable threads
+ *
+ * Only used in dedicated mode, where no hwallocd watches the runqueues. The
+ * most recently parked kthread is woken since its caches are the warmest.
+ * Must be called with preemption disabled.
+ */
+void kthread_wake_idle(void)
+{
+    struct kthread *k;
+    int val;
+
+    /* order the caller's runqueue update, see kthread_park_dedicated() */
+    mb();
+    if (load_acquire(&nr_idleks) == 0)
+        return;
+
+    spin_lock(&idle_lock);
+    if (nr_idleks == 0) {
+        spin_unlock(&idle_lock);
+        return;
+    }
+    k = idleks[--nr_idleks];
+    val = atomic_xchg(&k->q_ptrs->park_word, k->curr_cpu + 1);
+    spin_unlock(&idle_lock);
+
+    /* no syscall needed if the kthread is still spinning */
+    if (val == PARK_WORD_SLEEPING) {
+        syscall(SYS_futex, &k->q_ptrs->park_word.cnt, FUTEX_WAKE, 1,
+                NULL, NULL, 0);
+    }
+}
+
+/*
+ * kthread_yield_to_iokernel - block until iokernel wakes us up
  */
 static void kthread_yield_to_iokernel(void)
 {
@@ -184,6 +382,11 @@ static void kthread_yield_to_iokernel(void)
 
     clear_preempt_needed();
 
+    if (park_futex) {
+        assigned_core = kthread_wait_park_word(k, 0);
+        goto woken;
+    }
+
     /* yield to the iokernel */
     s = read(k->park_efd, &assigned_core, sizeof(assigned_core));
     while (unlikely(s != sizeof(uint64_t) && errno == EINTR)) {
@@ -194,6 +397,7 @@ static void kthread_yield_to_iokernel(void)
     }
     BUG_ON(s != sizeof(uint64_t));
 
+woken:
     k->curr_cpu = assigned_core - 1;
     store_release(&cpu_map[assigned_core - 1].recent_kthread, k);
 }
@@ -246,10 +450,31 @@ void kthread_park(bool voluntary)
     }
 
     k->parked = true;
+
+    /*
+     * A post either sees us parked (see kthread_post()) or we see it here.
+     * After an involuntary park hwallocd has another kthread join us anyway.
+     */
+    mb();
+    if (voluntary && unlikely(mesh_ready(k))) {
+        k->parked = false;
+        atomic_inc(&runningks);
+        return;
+    }
+
     k->park_us = now;
     //STAT(PARKS)++;
     spin_unlock(&k->lock);
 
+    if (dedicated_mode) {
+        kthread_park_dedicated(k, timer_earliest_deadline());
+        goto unparked;
+    }
+
+    /* arm the park futex before the iokernel can see the park */
+    if (park_futex)
+        atomic_write(&k->q_ptrs->park_word, PARK_WORD_PARKED);
+
     /* signal to iokernel that we're about to park */
     while (!lrpc_send(&k->txq, cmd, payload))
         cpu_relax();
@@ -258,6 +483,7 @@ void kthread_park(bool voluntary)
 
     /* iokernel has unparked us */
 
+unparked:
     spin_lock(&k->lock);
     k->parked = false;
     atomic_inc(&runningks);
@@ -274,7 +500,9 @@ void kthread_park(bool voluntary)
  */
 void kthread_wait_to_attach(void)
 {
-    kthread_yield_to_iokernel();
+    /* dedicated kthreads already own their cores, and park once idle */
+    if (!dedicated_mode)
+        kthread_yield_to_iokernel();
 
     /* attach the kthread for the first time */
     kthread_attach();
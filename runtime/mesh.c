@@ -0,0 +1,218 @@
+/*
+ * mesh.c - posting closures to specific kthreads
+ *
+ * Every ordered pair of kthreads shares a single-producer single-consumer
+ * LRPC ring, so a uthread can hand a closure to any kthread without taking a
+ * lock. The sender flags its ring in the receiver's @mesh_pending bitmap, and
+ * the receiver runs the closures from its softirq handler. Closures normally
+ * run on the kthread they were posted to. A kthread rechecks its rings after
+ * marking itself parked, and a sender that finds the receiver parked (or
+ * detached, where no one steals from it) queues a uthread on its own kthread
+ * to drain the receiver's rings, so posts can't be stranded.
+ */
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <base/stddef.h>
+#include <base/bitmap.h>
+#include <base/log.h>
+#include <base/lrpc.h>
+#include <runtime/sync.h>
+#include <runtime/thread.h>
+
+#include "defs.h"
+
+/* maxks * maxks rings, indexed by [receiver][sender] */
+static struct mesh_ring *mesh_rings;
+
+static inline struct mesh_ring *mesh_ring(int dst, int src)
+{
+    return &mesh_rings[dst * maxks + src];
+}
+
+/* runs the closures posted to a parked kthread @arg from another kthread */
+static void mesh_drain(void *arg)
+{
+    struct kthread *r = (struct kthread *)arg;
+    struct lrpc_msg msgs[RUNTIME_SOFTIRQ_BUDGET];
+    unsigned int i, n;
+
+    /* later posts must queue another drain */
+    store_release(&r->mesh_rescue, false);
+
+    do {
+        spin_lock_np(&r->lock);
+        n = mesh_ready(r) ? mesh_recv(r, msgs, RUNTIME_SOFTIRQ_BUDGET) : 0;
+        spin_unlock_np(&r->lock);
+
+        for (i = 0; i < n; i++) {
+            thread_fn_t fn = (thread_fn_t)msgs[i].cmd;
+            fn((void *)msgs[i].payload);
+        }
+    } while (n);
+}
+
+/**
+ * kthread_post - runs a closure on a specific kthread
+ * @kidx: the id of the kthread (see thread_throw())
+ * @fn: the function to call
+ * @arg: an argument passed to @fn
+ *
+ * @fn runs from the target kthread's softirq handler, so it must not block.
+ * Spawn a thread from @fn for longer work. If the target kthread is parked,
+ * @fn runs on the calling kthread instead.
+ *
+ * Returns 0 if successful, -EINVAL if @kidx isn't a started kthread, or
+ * -EAGAIN if the ring to @kidx is full.
+ */
+int kthread_post(int kidx, thread_fn_t fn, void *arg)
+{
+    struct kthread *k, *r;
+    bool sent, rescue = false;
+
+    if (unlikely(kidx < 0 || kidx >= maxks))
+        return -EINVAL;
+    r = load_acquire(&allks[kidx]);
+    if (unlikely(!r))
+        return -EINVAL;
+
+    k = getk();
+    sent = lrpc_send(&k->mesh_out[kidx], (uint64_t)fn, (unsigned long)arg);
+    if (likely(sent)) {
+        /* order the send before checking if the receiver was notified */
+        mb();
+        if (!bitmap_atomic_test(r->mesh_pending, k->allks_idx))
+            bitmap_atomic_set(r->mesh_pending, k->allks_idx);
+
+        /* pairs with kthread_park(): it sees the post or we see it parked */
+        mb();
+        rescue = r != k && r->parked &&
+                 !ACCESS_ONCE(r->mesh_rescue) &&
+                 __sync_bool_compare_and_swap(&r->mesh_rescue, false, true);
+    }
+    putk();
+
+    if (unlikely(rescue) && unlikely(thread_spawn(mesh_drain, r))) {
+        /* stealers may still find it, but nothing else will */
+        store_release(&r->mesh_rescue, false);
+        log_warn_ratelimited("mesh: out of memory draining kthread %d",
+                             kidx);
+    }
+
+    return sent ? 0 : -EAGAIN;
+}
+
+/**
+ * mesh_ready - determines if a kthread's mesh should be drained now
+ * @k: the kthread that owns the mesh rings
+ *
+ * Returns true if the calling kthread may run @k's posted closures and at
+ * least one is pending.
+ */
+bool mesh_ready(struct kthread *k)
+{
+    int i;
+
+    if (k != myk() && !k->parked)
+        return false;
+
+    for (i = 0; i < BITMAP_LONG_SIZE(maxks); i++) {
+        if (ACCESS_ONCE(k->mesh_pending[i]))
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * mesh_recv - receives closures posted to a kthread
+ * @k: the kthread that owns the mesh rings
+ * @msgs: an array to store the closures (fn in cmd, arg in payload)
+ * @budget: the maximum number of closures to receive
+ *
+ * @k->lock must be held, which serializes the consumers of @k's rings.
+ *
+ * Returns the number of closures received.
+ */
+unsigned int mesh_recv(struct kthread *k, struct lrpc_msg *msgs,
+                       unsigned int budget)
+{
+    unsigned long pending;
+    unsigned int cnt = 0;
+    int i, src;
+
+    assert_spin_lock_held(&k->lock);
+
+    for (i = 0; i < BITMAP_LONG_SIZE(maxks); i++) {
+        if (!ACCESS_ONCE(k->mesh_pending[i]))
+            continue;
+
+        pending = atomic64_fetch_and_and((atomic64_t *)&k->mesh_pending[i],
+                                         0);
+        while (pending) {
+            src = i * BITS_PER_LONG + __builtin_ctzl(pending);
+            pending &= pending - 1;
+
+            cnt += lrpc_recv_burst(&k->mesh_in[src], msgs + cnt,
+                                   budget - cnt);
+
+            /* out of budget, leave the rest for next time */
+            if (!lrpc_empty(&k->mesh_in[src]))
+                bitmap_atomic_set(k->mesh_pending, src);
+        }
+    }
+
+    return cnt;
+}
+
+/**
+ * mesh_init_thread - attaches the local kthread to the mesh rings
+ *
+ * Returns 0 if successful, or -ENOMEM if out of memory.
+ */
+int mesh_init_thread(void)
+{
+    struct kthread *k = myk();
+    struct mesh_ring *ring;
+    int i, ret;
+
+    k->mesh_in = aligned_alloc(CACHE_LINE_SIZE,
+        align_up(sizeof(*k->mesh_in) * maxks, CACHE_LINE_SIZE));
+    k->mesh_out = aligned_alloc(CACHE_LINE_SIZE,
+        align_up(sizeof(*k->mesh_out) * maxks, CACHE_LINE_SIZE));
+    if (!k->mesh_in || !k->mesh_out)
+        return -ENOMEM;
+
+    for (i = 0; i < maxks; i++) {
+        ring = mesh_ring(k->allks_idx, i);
+        ret = lrpc_init_in(&k->mesh_in[i], ring->tbl, RUNTIME_MESH_SIZE,
+                           &ring->recv_head_wb);
+        BUG_ON(ret);
+
+        ring = mesh_ring(i, k->allks_idx);
+        ret = lrpc_init_out(&k->mesh_out[i], ring->tbl, RUNTIME_MESH_SIZE,
+                            &ring->recv_head_wb);
+        BUG_ON(ret);
+    }
+
+    return 0;
+}
+
+/**
+ * mesh_init - allocates the kthread mesh rings
+ *
+ * Returns 0 if successful, or -ENOMEM if out of memory.
+ */
+int mesh_init(void)
+{
+    size_t len = align_up(sizeof(struct mesh_ring) * maxks * maxks,
+                          PGSIZE_4KB);
+
+    /* the rings must start zeroed for the LRPC parity scheme */
+    mesh_rings = mem_map_anom(NULL, len, PGSIZE_4KB, 0);
+    if (mesh_rings == MAP_FAILED)
+        return -ENOMEM;
+
+    return 0;
+}
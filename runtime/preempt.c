@@ -4,6 +4,7 @@
 
 #include <signal.h>
 #include <string.h>
+#include <time.h>
 
 #include "base/log.h"
 #include "runtime/thread.h"
@@ -14,15 +15,71 @@
 /* the current preemption count */
 volatile __thread unsigned int preempt_cnt = PREEMPT_NOT_PENDING;
 
+/* never raised, for kthreads that aren't attached to their q_ptrs yet */
+static uint32_t preempt_flag_off;
+/* the shared flag hwallocd raises to preempt this kthread */
+__thread volatile uint32_t *preempt_flag = &preempt_flag_off;
+
+/* how long a uthread may run while others wait on its kthread, 0 if forever */
+unsigned int quantum_us;
+/* pick @quantum_us from the runtime's priority class */
+bool quantum_auto;
+/* end time slices at the next safepoint instead of in the signal handler */
+bool quantum_cooperative;
+/* the uthread running at the last quantum tick, reset when switching in */
+__thread thread_t *quantum_thread;
+
+static const unsigned int quantum_class_us[SCHED_PRIORITY_NR] = {
+    [SCHED_PRIORITY_SYSTEM] = RUNTIME_QUANTUM_SYSTEM_US,
+    [SCHED_PRIORITY_NORMAL] = RUNTIME_QUANTUM_NORMAL_US,
+    [SCHED_PRIORITY_BATCH]  = RUNTIME_QUANTUM_BATCH_US,
+};
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 /* set a flag to indicate a preemption request is pending */
 static void set_preempt_needed(void)
 {
     preempt_cnt &= ~PREEMPT_NOT_PENDING;
 }
 
+/**
+ * preempt_flag_raised - acts on the requests in the shared preempt flag
+ *
+ * A core request from the iokernel becomes a pending preemption, which the
+ * caller takes at the next point preemption is enabled, well before the
+ * iokernel gives up and sends SIGUSR1. A finished time slice yields right
+ * away if preemption is enabled, and otherwise stays raised until it is.
+ */
+void preempt_flag_raised(void)
+{
+    uint32_t flag = *preempt_flag;
+
+    if (flag & PREEMPT_FLAG_CORE) {
+        __atomic_and_fetch(preempt_flag, ~PREEMPT_FLAG_CORE, __ATOMIC_RELAXED);
+        set_preempt_needed();
+    }
+
+    if (!(flag & PREEMPT_FLAG_YIELD) || !preempt_enabled())
+        return;
+
+    __atomic_and_fetch(preempt_flag, ~PREEMPT_FLAG_YIELD, __ATOMIC_RELAXED);
+
+    /* giving up the kthread requeues this uthread anyway */
+    if (preempt_needed())
+        return;
+
+    quantum_thread = NULL;
+    thread_yield();
+}
+
 /* handles preemption signals from the iokernel */
 static void handle_sigusr1(int s, siginfo_t *si, void *c)
 {
+    /* a pending time slice yield is still owed once preemption is enabled */
+    __atomic_and_fetch(preempt_flag, ~PREEMPT_FLAG_CORE, __ATOMIC_RELAXED);
     set_preempt_needed();
 
     /* resume execution if preemption is disabled */
@@ -32,6 +89,46 @@ static void handle_sigusr1(int s, siginfo_t *si, void *c)
     thread_yield_kthread();
 }
 
+/*
+ * handles quantum ticks, which arrive every @quantum_us of kthread CPU time
+ *
+ * A uthread still running at two consecutive ticks yields to the uthreads
+ * queued behind it. Yielding is only safe with preemption enabled; otherwise
+ * the next tick tries again. In cooperative mode the handler only raises
+ * PREEMPT_FLAG_YIELD, so no uthread is switched out from signal context.
+ */
+static void handle_quantum(int s, siginfo_t *si, void *c)
+{
+    struct kthread *k = myk();
+    thread_t *th = __self;
+
+    if (!th)
+        return;
+
+    if (quantum_thread != th) {
+        quantum_thread = th;
+        return;
+    }
+
+    /* keep running if nothing is waiting on this kthread */
+    if (ACCESS_ONCE(k->rq_head) == ACCESS_ONCE(k->rq_tail) &&
+        ACCESS_ONCE(k->rrq_head) == ACCESS_ONCE(k->rrq_tail) &&
+        list_empty(&k->rq_overflow))
+        return;
+
+    /* leave the yield to the next safepoint or preempt_enable() */
+    if (quantum_cooperative) {
+        __atomic_or_fetch(preempt_flag, PREEMPT_FLAG_YIELD, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (!preempt_enabled())
+        return;
+
+    quantum_thread = NULL;
+    thread_yield();
+}
+
 /* handles kthread termination signals */
 static void handle_sigusr2(int s, siginfo_t *si, void *c)
 {
@@ -56,8 +153,12 @@ int preempt_init(void)
 {
     struct sigaction act;
 
+    /*
+     * The handler switches away from the interrupted uthread, so it must run
+     * on that uthread's stack rather than on the alternate signal stack.
+     */
     act.sa_sigaction = handle_sigusr1;
-    act.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER | SA_RESTART;
+    act.sa_flags = SA_SIGINFO | SA_NODEFER | SA_RESTART;
 
     if (sigemptyset(&act.sa_mask) != 0) {
         log_err("couldn't empty the signal handler mask");
@@ -69,6 +170,19 @@ int preempt_init(void)
         return -errno;
     }
 
+    if (quantum_auto)
+        quantum_us = quantum_class_us[cfg_priority];
+    if (quantum_us) {
+        log_info("preempt: %u us %s time slices", quantum_us,
+                 quantum_cooperative ? "cooperative" : "signal");
+
+        act.sa_sigaction = handle_quantum;
+        if (sigaction(RUNTIME_QUANTUM_SIGNAL, &act, NULL) == -1) {
+            log_err("couldn't register quantum signal handler");
+            return -errno;
+        }
+    }
+
     struct sigaction act2;
 
     act2.sa_sigaction = handle_sigusr2;
@@ -86,3 +200,40 @@ int preempt_init(void)
 
     return 0;
 }
+
+/**
+ * preempt_init_thread - starts the quantum timer of this kthread
+ *
+ * The timer counts the kthread's CPU time, so it stays quiet while parked.
+ *
+ * Returns 0 if successful. otherwise fail.
+ */
+int preempt_init_thread(void)
+{
+    struct sigevent sev;
+    struct itimerspec its;
+    timer_t timer;
+
+    if (!quantum_us)
+        return 0;
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = RUNTIME_QUANTUM_SIGNAL;
+    sev.sigev_notify_thread_id = thread_gettid();
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer) == -1) {
+        log_err("couldn't create quantum timer");
+        return -errno;
+    }
+
+    its.it_value.tv_sec = quantum_us / ONE_SECOND;
+    its.it_value.tv_nsec = quantum_us % ONE_SECOND * 1000;
+    its.it_interval = its.it_value;
+    if (timer_settime(timer, 0, &its, NULL) == -1) {
+        log_err("couldn't arm quantum timer");
+        timer_delete(timer);
+        return -errno;
+    }
+
+    return 0;
+}
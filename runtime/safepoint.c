@@ -0,0 +1,20 @@
+/*
+ * safepoint.c - compiler-inserted safepoints
+ *
+ * Code built with -finstrument-functions (SAFEPOINT_CFLAGS in the Makefile)
+ * calls these hooks around every function, which turns each call into a
+ * ut_safepoint(). Only instrumented programs pull this file in.
+ */
+
+#include <runtime/preempt.h>
+
+#define __no_instrument __attribute__((no_instrument_function))
+
+void __no_instrument __cyg_profile_func_enter(void *fn, void *site)
+{
+    ut_safepoint();
+}
+
+void __no_instrument __cyg_profile_func_exit(void *fn, void *site)
+{
+}
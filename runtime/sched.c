@@ -49,6 +49,14 @@ static __thread uint64_t last_watchdog_tsc;
  */
 thread_t *thread_self(void);
 
+/* starts a new time slice, dropping any yield meant for the last uthread */
+static __always_inline void quantum_slice_restart(void)
+{
+    quantum_thread = NULL;
+    if (unlikely(*preempt_flag & PREEMPT_FLAG_YIELD))
+        __atomic_and_fetch(preempt_flag, ~PREEMPT_FLAG_YIELD, __ATOMIC_RELAXED);
+}
+
 /**
  * jmp_thread - runs a thread, popping its trap frame
  * @th: the thread to run
@@ -62,13 +70,21 @@ static __noreturn void jmp_thread(thread_t *th)
     assert(th->state == THREAD_STATE_RUNNABLE);
 
     __self = th;
+    quantum_slice_restart();
     th->state = THREAD_STATE_RUNNING;
     if (unlikely(load_acquire(&th->stack_busy))) {
         /* wait until the scheduler finishes switching stacks */
         while (load_acquire(&th->stack_busy))
             cpu_relax();
     }
-    __jmp_thread(&th->tf);
+    switch (th->fp_mode) {
+    case THREAD_FP_NONE:
+        __jmp_thread_nofp(&th->tf);
+    case THREAD_FP_VEC:
+        __jmp_thread_vec(&th->tf);
+    default:
+        __jmp_thread(&th->tf);
+    }
 }
 
 /**
@@ -81,17 +97,35 @@ static __noreturn void jmp_thread(thread_t *th)
  */
 static void jmp_thread_direct(thread_t *oldth, thread_t *newth)
 {
+    int fp_mode;
+
     assert_preempt_disabled();
     assert(newth->state == THREAD_STATE_RUNNABLE);
 
     __self = newth;
+    quantum_slice_restart();
     newth->state = THREAD_STATE_RUNNING;
     if (unlikely(load_acquire(&newth->stack_busy))) {
         /* wait until the scheduler finishes switching stacks */
         while (load_acquire(&newth->stack_busy))
             cpu_relax();
     }
-    __jmp_thread_direct(&oldth->tf, &newth->tf, &oldth->stack_busy);
+
+    /* the modes nest, so the larger one covers both threads */
+    fp_mode = oldth->fp_mode;
+    if (newth->fp_mode > fp_mode)
+        fp_mode = newth->fp_mode;
+
+    switch (fp_mode) {
+    case THREAD_FP_NONE:
+        __jmp_thread_direct_nofp(&oldth->tf, &newth->tf, &oldth->stack_busy);
+        break;
+    case THREAD_FP_VEC:
+        __jmp_thread_direct_vec(&oldth->tf, &newth->tf, &oldth->stack_busy);
+        break;
+    default:
+        __jmp_thread_direct(&oldth->tf, &newth->tf, &oldth->stack_busy);
+    }
 }
 
 /**
@@ -106,10 +140,21 @@ static void jmp_thread_direct(thread_t *oldth, thread_t *newth)
  */
 static void jmp_runtime(runtime_fn_t fn)
 {
-    assert_preempt_disabled();
-    assert(thread_self() != NULL);
+    thread_t *th = thread_self();
 
-    __jmp_runtime(&thread_self()->tf, fn, runtime_stack);
+    assert_preempt_disabled();
+    assert(th != NULL);
+
+    switch (th->fp_mode) {
+    case THREAD_FP_NONE:
+        __jmp_runtime_nofp(&th->tf, fn, runtime_stack);
+        break;
+    case THREAD_FP_VEC:
+        __jmp_runtime_vec(&th->tf, fn, runtime_stack);
+        break;
+    default:
+        __jmp_runtime(&th->tf, fn, runtime_stack);
+    }
 }
 
 /**
@@ -147,6 +192,55 @@ void ret_pthread()
     __jmp_thread(&pthread_tf);
 }
 
+/**
+ * rq_publish_oldest - reports the oldest runnable thread to the hwallocd
+ * @k: the kthread whose runqueue changed
+ *
+ * Must be called by @k's own kthread, after removing from the runqueue or
+ * after adding to an empty one.
+ */
+static inline void rq_publish_oldest(struct kthread *k)
+{
+    uint64_t tsc = 0;
+
+    if (k->rq_head != k->rq_tail)
+        tsc = k->rq[k->rq_tail % RUNTIME_RQ_SIZE]->ready_tsc;
+    ACCESS_ONCE(k->q_ptrs->oldest_tsc) = tsc;
+}
+
+/**
+ * rq_publish_oldest_remote - rq_publish_oldest() after stealing from @r
+ * @r: the kthread whose runqueue was stolen from
+ *
+ * @r->lock must be held. @r may be adding to its runqueue at the same time,
+ * publishing its own report if it found the runqueue empty, so only replace
+ * the report that was read here, and report again if a thread arrived.
+ */
+static void rq_publish_oldest_remote(struct kthread *r)
+{
+    uint64_t old, tsc = 0;
+    uint32_t rq_head;
+
+    /*
+     * Pairs with the barrier in thread_ready() after the caller's rq_tail
+     * update. The owner makes a thread visible in rq_head before reporting
+     * it, so a report read here means its thread is visible below.
+     */
+    mb();
+    old = load_acquire(&r->q_ptrs->oldest_tsc);
+    rq_head = load_acquire(&r->rq_head);
+    if (rq_head != r->rq_tail)
+        tsc = r->rq[r->rq_tail % RUNTIME_RQ_SIZE]->ready_tsc;
+    if (!__sync_bool_compare_and_swap(&r->q_ptrs->oldest_tsc, old, tsc))
+        return;
+
+    /* a thread enqueued after all, but without the owner reporting it */
+    if (unlikely(!tsc && load_acquire(&r->rq_head) != rq_head)) {
+        tsc = r->rq[r->rq_tail % RUNTIME_RQ_SIZE]->ready_tsc;
+        __sync_bool_compare_and_swap(&r->q_ptrs->oldest_tsc, 0, tsc);
+    }
+}
+
 static void drain_overflow(struct kthread *l)
 {
     thread_t *th;
@@ -160,6 +254,7 @@ static void drain_overflow(struct kthread *l)
         l->rq[l->rq_head++ % RUNTIME_RQ_SIZE] = th;
         l->q_ptrs->rq_head++;
     }
+    rq_publish_oldest(l);
 }
 
 static bool steal_work(struct kthread *l, struct kthread *r)
@@ -190,10 +285,12 @@ static bool steal_work(struct kthread *l, struct kthread *r)
             l->rq[i] = r->rq[rq_tail++ % RUNTIME_RQ_SIZE];
         store_release(&r->rq_tail, rq_tail);
         r->q_ptrs->rq_tail += avail;
+        rq_publish_oldest_remote(r);
         spin_unlock(&r->lock);
 
         l->rq_head = avail;
         l->q_ptrs->rq_head += avail;
+        rq_publish_oldest(l);
         return true;
     }
 
@@ -213,6 +310,7 @@ done:
     if (th) {
         l->rq[l->rq_head++] = th;
         l->q_ptrs->rq_head++;
+        rq_publish_oldest(l);
     } else if (r->parked) {
         kthread_detach(r);
     }
@@ -343,6 +441,8 @@ again:
     }
 
     /* keep trying to find work until the polling timeout expires */
+    if (unlikely(*preempt_flag))
+        preempt_flag_raised();
     if (!preempt_needed() &&
         (++iters < RUNTIME_SCHED_POLL_MAX ||
          libut_rdtsc() - start_tsc <
@@ -362,6 +462,7 @@ done:
         assert(l->rq_head != l->rq_tail);
         th = l->rq[l->rq_tail++ % RUNTIME_RQ_SIZE];
         l->q_ptrs->rq_tail++;
+        rq_publish_oldest(l);
     }
 
     /* move overflow tasks into the runqueue */
@@ -413,6 +514,7 @@ void join_kthread(struct kthread *k)
         k->q_ptrs->rq_tail++;
     }
     k->rq_head = k->rq_tail = 0;
+    ACCESS_ONCE(k->q_ptrs->oldest_tsc) = 0;
 
     /* drain the overflow runqueue */
     list_append_list(&tmp, &k->rq_overflow);
@@ -465,6 +567,7 @@ static __always_inline void enter_schedule(thread_t *myth)
     /* pop the next runnable thread from the queue */
     th = k->rq[k->rq_tail++ % RUNTIME_RQ_SIZE];
     k->q_ptrs->rq_tail++;
+    rq_publish_oldest(k);
     spin_unlock(&k->lock);
 
     /* increment the RCU generation number (odd is in thread) */
@@ -540,6 +643,7 @@ void thread_ready(thread_t *th)
 
     assert(th->state == THREAD_STATE_SLEEPING);
     th->state = THREAD_STATE_RUNNABLE;
+    th->ready_tsc = libut_rdtsc();
 
     k = getk();
     rq_tail = load_acquire(&k->rq_tail);
@@ -548,13 +652,24 @@ void thread_ready(thread_t *th)
         spin_lock(&k->lock);
         list_add_tail(&k->rq_overflow, &th->link);
         spin_unlock(&k->lock);
-        putk();
-        return;
+        goto out;
     }
 
     k->rq[k->rq_head % RUNTIME_RQ_SIZE] = th;
     store_release(&k->rq_head, k->rq_head + 1);
+    /*
+     * Either a stealer that empties the runqueue sees our rq_head, or we see
+     * its rq_tail here (see rq_publish_oldest_remote()).
+     */
+    mb();
+    if (load_acquire(&k->rq_tail) == k->rq_head - 1)
+        store_release(&k->q_ptrs->oldest_tsc, th->ready_tsc);
     k->q_ptrs->rq_head++;
+
+out:
+    /* without hwallocd, hand the work to a parked kthread ourselves */
+    if (unlikely(dedicated_mode))
+        kthread_wake_idle();
     putk();
 }
 
@@ -587,6 +702,7 @@ void thread_throw(thread_t *th, int kidx)
     if (r && spin_try_lock_np(&r->lock)) {
         if (likely(!(r->detached || r->parked))) {
             th->state = THREAD_STATE_RUNNABLE;
+            th->ready_tsc = libut_rdtsc();
             if (unlikely(r->rrq_head - r->rrq_tail >= RUNTIME_RRQ_SIZE)) {
                 list_add_tail(&r->rq_overflow, &th->link);
             } else {
@@ -676,6 +792,9 @@ static __always_inline thread_t *__thread_create(void)
     th->stack = s;
     th->state = THREAD_STATE_SLEEPING;
     th->main_thread = false;
+    th->fp_mode = THREAD_FP_FULL;
+    th->arena_pages = NULL;
+    th->arena_pos = th->arena_end = 0;
 
     return th;
 }
@@ -700,10 +819,34 @@ thread_t *thread_create(thread_fn_t fn, void *arg)
     ARG0(&(th->tf)) = (uint64_t)arg;
     BPTR(&(th->tf)) = (uint64_t)0; /* just in case base pointers are enabled */
     IPTR(&(th->tf)) = (uint64_t)fn;
+    FP_INIT(&(th->tf));
     th->stack_busy = false;
     return th;
 }
 
+/**
+ * thread_create_fp - creates a new thread that keeps less floating point state
+ * @fn: a function pointer to the starting method of the thread
+ * @arg: an argument passed to @fn
+ * @fp_mode: the state to save and restore across switches (THREAD_FP_*)
+ *
+ * Returns 0 if successful, otherwise -ENOMEM if out of memory.
+ */
+thread_t *thread_create_fp(thread_fn_t fn, void *arg, int fp_mode)
+{
+    thread_t *th;
+
+    if (unlikely(fp_mode < THREAD_FP_NONE || fp_mode > THREAD_FP_FULL))
+        return NULL;
+
+    th = thread_create(fn, arg);
+    if (unlikely(!th))
+        return NULL;
+
+    th->fp_mode = fp_mode;
+    return th;
+}
+
 /**
  * thread_create_with_buf - creates a new thread with space for a buffer on the
  * stack
@@ -720,6 +863,15 @@ thread_t *thread_create_with_buf(thread_fn_t fn, void **buf, size_t buf_len)
     if (unlikely(!th))
         return NULL;
 
+    /* the buffer is written by the caller, not by a fault on the stack */
+    if (unlikely(stack_commit(th->stack, buf_len + PGSIZE_4KB))) {
+        preempt_disable();
+        stack_free(th->stack);
+        tcache_free(&__perthread_thread_pt, th);
+        preempt_enable();
+        return NULL;
+    }
+
     SPTR(&(th->tf)) = stack_init_to_rsp_with_buf(th->stack, &ptr,
                         buf_len, thread_exit);
 #if defined(__aarch64__)
@@ -728,6 +880,7 @@ thread_t *thread_create_with_buf(thread_fn_t fn, void **buf, size_t buf_len)
     ARG0(&(th->tf)) = (uint64_t)ptr;
     BPTR(&(th->tf)) = (uint64_t)0; /* just in case base pointers are enabled */
     IPTR(&(th->tf)) = (uint64_t)fn;
+    FP_INIT(&(th->tf));
     th->stack_busy = false;
     *buf = ptr;
     return th;
@@ -799,6 +952,7 @@ static void thread_finish_exit(void)
         ret_pthread();
         return;
     }
+    arena_release(th);
     stack_free(th->stack);
     tcache_free(&__perthread_thread_pt, th);
     __self = NULL;
@@ -867,6 +1021,10 @@ int sched_init_thread(void)
     if (!s)
         return -ENOMEM;
 
+    /* the runtime stack never grows on demand */
+    if (stack_commit(s, RUNTIME_STACK_SIZE))
+        return -ENOMEM;
+
     runtime_stack_base = (void *)s;
     runtime_stack = (void *)stack_init_to_rsp(s, runtime_top_of_stack); 
 
@@ -886,7 +1044,7 @@ int sched_init(void)
      * set up allocation routines for threads
      */
     ret = slab_create(&thread_slab, "runtime_threads",
-              sizeof(thread_t), 0);
+              sizeof(thread_t), SLAB_FLAG_SCALABLE);
     if (ret)
         return ret;
 
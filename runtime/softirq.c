@@ -12,11 +12,12 @@
 */
 
 struct softirq_work {
-    unsigned int recv_cnt, compl_cnt, join_cnt, timer_budget;
+    unsigned int recv_cnt, compl_cnt, join_cnt, post_cnt, timer_budget;
     struct kthread *k;
     struct rx_net_hdr *recv_reqs[SOFTIRQ_MAX_BUDGET];
     struct mbuf *compl_reqs[SOFTIRQ_MAX_BUDGET];
     struct kthread *join_reqs[SOFTIRQ_MAX_BUDGET];
+    struct lrpc_msg post_reqs[SOFTIRQ_MAX_BUDGET];
 };
 
 static void softirq_fn(void *arg)
@@ -31,36 +32,46 @@ static void softirq_fn(void *arg)
     /* join parked kthreads */
     for (i = 0; i < w->join_cnt; i++)
         join_kthread(w->join_reqs[i]);
+
+    /* run closures posted by other kthreads */
+    for (i = 0; i < w->post_cnt; i++) {
+        thread_fn_t fn = (thread_fn_t)w->post_reqs[i].cmd;
+        fn((void *)w->post_reqs[i].payload);
+    }
 }
 
 static void softirq_gather_work(struct softirq_work *w, struct kthread *k,
-                unsigned int budget)
+                unsigned int budget, bool mesh)
 {
-    unsigned int recv_cnt = 0, compl_cnt = 0, join_cnt = 0;
+    unsigned int recv_cnt = 0, compl_cnt = 0, join_cnt = 0, post_cnt = 0;
+    struct lrpc_msg msgs[SOFTIRQ_MAX_BUDGET];
+    unsigned int i, n;
     int budget_left;
 
     budget_left = libut_min(budget, SOFTIRQ_MAX_BUDGET);
-    while (budget_left--) {
-        uint64_t cmd;
-        unsigned long payload;
-
-        if (!lrpc_recv(&k->rxq, &cmd, &payload))
-            break;
-
-        switch (cmd) {
+    n = lrpc_recv_burst(&k->rxq, msgs, budget_left);
+    budget_left -= n;
+    for (i = 0; i < n; i++) {
+        switch (msgs[i].cmd) {
         case RXCMD_JOIN:
-            w->join_reqs[join_cnt++] = (struct kthread *)payload;
+            w->join_reqs[join_cnt++] = (struct kthread *)msgs[i].payload;
             break;
 
         default:
-            log_err_ratelimited("net: invalid RXQ cmd '%ld'", cmd);
+            log_err_ratelimited("net: invalid RXQ cmd '%ld'", msgs[i].cmd);
         }
     }
 
+    if (mesh && budget_left > 0 && mesh_ready(k)) {
+        post_cnt = mesh_recv(k, w->post_reqs, budget_left);
+        budget_left -= post_cnt;
+    }
+
     w->k = k;
     w->recv_cnt = recv_cnt;
     w->compl_cnt = compl_cnt;
     w->join_cnt = join_cnt;
+    w->post_cnt = post_cnt;
     w->timer_budget = budget_left;
 }
 
@@ -80,15 +91,16 @@ thread_t *softirq_run_thread(struct kthread *k, unsigned int budget)
     assert_spin_lock_held(&k->lock);
 
     /* check if there's any work available */
-    if (lrpc_empty(&k->rxq) && !timer_needed(k))
+    if (lrpc_empty(&k->rxq) && !timer_needed(k) && !mesh_ready(k))
         return NULL;
 
     th = thread_create_with_buf(softirq_fn, (void **)&w, sizeof(*w));
     if (unlikely(!th))
         return NULL;
 
-    softirq_gather_work(w, k, budget);
+    softirq_gather_work(w, k, budget, true);
     th->state = THREAD_STATE_RUNNABLE;
+    th->ready_tsc = libut_rdtsc();
     return th;
 }
 
@@ -108,8 +120,12 @@ void softirq_run(unsigned int budget)
         return;
     }
 
+    /*
+     * Posted closures are left to softirq_run_thread(), since this thread
+     * could migrate to another kthread before running them.
+     */
     spin_lock(&k->lock);
-    softirq_gather_work(&w, k, budget);
+    softirq_gather_work(&w, k, budget, false);
     spin_unlock(&k->lock);
     putk();
 
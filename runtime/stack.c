@@ -1,14 +1,32 @@
 /*
  * stack.c - allocates and manages per-thread stacks
+ *
+ * Stacks can optionally be growable: only the top @stack_commit_size bytes of
+ * a new stack are accessible, and the rest of the usable area is PROT_NONE.
+ * A fault on the inaccessible part is caught by a SIGSEGV handler (running on
+ * a per-kthread alternate signal stack), which extends the stack in place up
+ * to @stack_max_size bytes.
+ *
+ * Alternatively, stacks can be carved out of per-kthread 2MB huge page arenas
+ * to reduce TLB misses when switching among many uthreads. Huge pages can't
+ * be protected at 4KB granularity, so these stacks are packed back-to-back
+ * without guard pages ("trusted" mode). The arenas are mapped into one
+ * reserved address range, which tells their stacks apart from the 4KB ones
+ * used once huge pages run out.
  */
 
+#include <signal.h>
+#include <stdlib.h>
 #include <sys/mman.h>
+#include <ucontext.h>
 
 #include <base/stddef.h>
 #include <base/lock.h>
 #include <base/atomic.h>
 #include <base/limits.h>
 #include <base/log.h>
+#include <base/mem.h>
+#include <base/thread.h>
 
 #include "defs.h"
 
@@ -17,6 +35,28 @@
 static struct tcache *stack_tcache;
 __thread struct tcache_perthread __perthread_stack_pt;
 
+size_t stack_commit_size;
+size_t stack_max_size = RUNTIME_STACK_SIZE;
+bool stack_hugepage;
+
+/* the unused part of this kthread's current huge page arena */
+static __thread char *stack_arena_pos, *stack_arena_end;
+/* the address range reserved for all arenas, and the next free arena in it */
+static uintptr_t stack_arenas_start, stack_arenas_end;
+static atomic64_t stack_arenas_pos;
+/* set once huge pages ran out, so later allocations don't retry */
+static bool stack_arenas_failed;
+
+/* the SIGSEGV disposition to fall back to for faults outside of stacks */
+static struct sigaction stack_prev_segv;
+/* the stack pointer at the last failed signal delivery on this kthread */
+static __thread uintptr_t stack_last_kernel_sp;
+
+static inline uintptr_t stack_top(struct stack *s)
+{
+    return (uintptr_t)s->guard;
+}
+
 static struct stack *stack_create(void *base)
 {
     void *stack_addr;
@@ -28,20 +68,187 @@ static struct stack *stack_create(void *base)
         return NULL;
 
     s = (struct stack *)stack_addr;
-    if (mprotect(s->guard, RUNTIME_GUARD_SIZE, PROT_NONE) == - 1) {
-        munmap(stack_addr, sizeof(struct stack));
-        return NULL;
+    if (mprotect(s->guard, RUNTIME_GUARD_SIZE, PROT_NONE) == - 1)
+        goto fail;
+
+    /* growable stacks start with only the top part accessible */
+    if (stack_commit_size &&
+        mprotect(s->usable, (RUNTIME_STACK_SIZE) - stack_commit_size,
+                 PROT_NONE) == -1)
+        goto fail;
+
+    return s;
+
+fail:
+    munmap(stack_addr, sizeof(struct stack));
+    return NULL;
+}
+
+static inline bool stack_in_arena(struct stack *s)
+{
+    return (uintptr_t)s >= stack_arenas_start &&
+           (uintptr_t)s < stack_arenas_end;
+}
+
+static struct stack *stack_create_from_arena(void)
+{
+    struct stack *s;
+    uintptr_t base;
+    void *arena;
+
+    if (stack_arena_pos == stack_arena_end) {
+        if (load_acquire(&stack_arenas_failed))
+            return NULL;
+
+        base = atomic64_fetch_and_add(&stack_arenas_pos,
+                                      RUNTIME_STACK_ARENA_SIZE);
+        if (base + RUNTIME_STACK_ARENA_SIZE > stack_arenas_end)
+            goto fail;
+
+        arena = mem_map_anom((void *)base, RUNTIME_STACK_ARENA_SIZE,
+                             PGSIZE_2MB, thread_numa_node);
+        if (arena == MAP_FAILED) {
+            /* a failed fixed mapping may leave a hole, keep it reserved */
+            mmap((void *)base, RUNTIME_STACK_ARENA_SIZE, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                 -1, 0);
+            goto fail;
+        }
+
+        stack_arena_pos = (char *)arena;
+        stack_arena_end = stack_arena_pos + RUNTIME_STACK_ARENA_SIZE;
     }
 
+    /* no guard, the next stack starts right where this one's guard would */
+    s = (struct stack *)stack_arena_pos;
+    stack_arena_pos += RUNTIME_STACK_SIZE;
     return s;
+
+fail:
+    store_release(&stack_arenas_failed, true);
+    log_warn_once("stack: out of 2mb pages, using 4kb pages");
+    return NULL;
+}
+
+/* reserves address space for enough arenas to hold every thread's stack */
+static int stack_reserve_arenas(void)
+{
+    size_t len = align_up((size_t)RUNTIME_MAX_THREADS * RUNTIME_STACK_SIZE,
+                          RUNTIME_STACK_ARENA_SIZE);
+    void *addr;
+
+    addr = mmap(NULL, len + RUNTIME_STACK_ARENA_SIZE, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+        return -errno;
+
+    stack_arenas_start = align_up((uintptr_t)addr, RUNTIME_STACK_ARENA_SIZE);
+    stack_arenas_end = stack_arenas_start + len;
+    atomic64_write(&stack_arenas_pos, stack_arenas_start);
+    return 0;
 }
 
 /* WARNING: the contents of the stack may be lost after reclaiming. */
 static void stack_reclaim(struct stack *s)
 {
     int ret;
+
+    /* huge pages can't be partially released, keep them resident */
+    if (stack_in_arena(s))
+        return;
+
     ret = madvise(s->usable, RUNTIME_STACK_SIZE, MADV_DONTNEED);
     WARN_ON_ONCE(ret);
+
+    /* shrink a grown stack back to its initial size */
+    if (stack_commit_size) {
+        ret = mprotect(s->usable, (RUNTIME_STACK_SIZE) - stack_commit_size,
+                       PROT_NONE);
+        WARN_ON_ONCE(ret);
+    }
+}
+
+/**
+ * stack_commit - makes the top of a stack accessible
+ * @s: the stack
+ * @len: the number of bytes (from the top) that must be accessible
+ *
+ * Only needed for growable stacks, when the stack is written to by a thread
+ * other than its owner (e.g. a buffer reserved by thread_create_with_buf()).
+ *
+ * Returns 0 if successful, otherwise -errno.
+ */
+int stack_commit(struct stack *s, size_t len)
+{
+    uintptr_t low;
+
+    if (!stack_commit_size || len <= stack_commit_size)
+        return 0;
+
+    len = libut_min(align_up(len, PGSIZE_4KB), (size_t)(RUNTIME_STACK_SIZE));
+    low = stack_top(s) - len;
+    if (mprotect((void *)low, len, PROT_READ | PROT_WRITE) == -1)
+        return -errno;
+    return 0;
+}
+
+/* returns the stack pointer of the context a signal interrupted */
+static uintptr_t stack_interrupted_sp(void *c)
+{
+    ucontext_t *uc = (ucontext_t *)c;
+
+#if defined(__aarch64__)
+    return uc->uc_mcontext.sp;
+#else
+    return uc->uc_mcontext.gregs[REG_RSP];
+#endif
+}
+
+/* handles faults on the inaccessible part of growable stacks */
+static void handle_sigsegv(int sig, siginfo_t *si, void *c)
+{
+    thread_t *th = thread_self();
+    uintptr_t addr = (uintptr_t)si->si_addr;
+    uintptr_t top, limit, low, sp;
+
+    if (!th)
+        goto fallback;
+
+    /*
+     * The kernel couldn't push the frame of a signal handled on the uthread
+     * stack (e.g. SIGUSR1), which reaches at most a grow step below the
+     * interrupted stack pointer. Grow to cover it, unless that already
+     * failed at the same point, e.g. because the fault wasn't a frame after
+     * all. The signal itself is lost.
+     */
+    if (si->si_code == SI_KERNEL) {
+        sp = stack_interrupted_sp(c);
+        if (sp == stack_last_kernel_sp)
+            goto fallback;
+        stack_last_kernel_sp = sp;
+        addr = sp - RUNTIME_STACK_GROW_SIZE;
+    } else if (si->si_code != SEGV_ACCERR) {
+        goto fallback;
+    }
+
+    top = stack_top(th->stack);
+    limit = top - stack_max_size;
+    if (addr < limit || addr >= top - stack_commit_size)
+        goto fallback;
+
+    /* extend past the fault so signal frames have room as well */
+    low = PGADDR_4KB(addr);
+    if (low - limit > RUNTIME_STACK_GROW_SIZE)
+        low -= RUNTIME_STACK_GROW_SIZE;
+    else
+        low = limit;
+
+    if (mprotect((void *)low, top - low, PROT_READ | PROT_WRITE) == 0)
+        return;
+
+fallback:
+    /* restore the old disposition, the access will fault again */
+    sigaction(SIGSEGV, &stack_prev_segv, NULL);
 }
 
 static DEFINE_SPINLOCK(stack_lock);
@@ -79,6 +286,12 @@ static int stack_tcache_alloc(struct tcache *tc, int nr, void **items)
 
 
     for (; i < nr; i++) {
+        if (stack_hugepage) {
+            items[i] = stack_create_from_arena();
+            if (likely(items[i]))
+                continue;
+        }
+
         base = (void *)atomic64_fetch_and_and(&stack_pos,
                               sizeof(struct stack));
         items[i] = stack_create(base);
@@ -105,7 +318,25 @@ static const struct tcache_ops stack_tcache_ops = {
  */
 int stack_init_thread(void)
 {
+    stack_t ss;
+
     tcache_init_perthread(stack_tcache, &__perthread_stack_pt);
+
+    if (!stack_commit_size)
+        return 0;
+
+    /* growth faults can't be handled on the stack that faulted */
+    ss.ss_sp = malloc(RUNTIME_ALTSTACK_SIZE);
+    if (!ss.ss_sp)
+        return -ENOMEM;
+    ss.ss_size = RUNTIME_ALTSTACK_SIZE;
+    ss.ss_flags = 0;
+    if (sigaltstack(&ss, NULL) == -1) {
+        log_err("stack: couldn't install the alternate signal stack");
+        free(ss.ss_sp);
+        return -errno;
+    }
+
     return 0;
 }
 
@@ -115,10 +346,41 @@ int stack_init_thread(void)
  */
 int stack_init(void)
 {
+    struct sigaction act;
+
     stack_tcache = tcache_create("runtime_stacks", &stack_tcache_ops,
                      TCACHE_DEFAULT_MAG_SIZE,
                      RUNTIME_STACK_SIZE);
     if (!stack_tcache)
         return -ENOMEM;
+
+    if (stack_hugepage && stack_reserve_arenas()) {
+        log_warn("stack: couldn't reserve space for huge page arenas");
+        stack_hugepage = false;
+    }
+
+    if (stack_hugepage)
+        log_info("stack: unguarded stacks in %d KB huge page arenas",
+                 RUNTIME_STACK_ARENA_SIZE / KB);
+
+    if (!stack_commit_size)
+        return 0;
+
+    log_info("stack: growable stacks, %ld KB committed, %ld KB max",
+             stack_commit_size / KB, stack_max_size / KB);
+
+    act.sa_sigaction = handle_sigsegv;
+    act.sa_flags = SA_SIGINFO | SA_ONSTACK;
+
+    if (sigemptyset(&act.sa_mask) != 0) {
+        log_err("couldn't empty the signal handler mask");
+        return -errno;
+    }
+
+    if (sigaction(SIGSEGV, &act, &stack_prev_segv) == -1) {
+        log_err("couldn't register signal handler");
+        return -errno;
+    }
+
     return 0;
 }
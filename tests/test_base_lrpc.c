@@ -1,5 +1,8 @@
 /*
  * test_base_lrpc.c - tests LRPC messaging
+ *
+ * Measures round trips with single messages, then one-way throughput with
+ * lrpc_send_burst() / lrpc_recv_burst() across burst sizes.
  */
 
 #include <stdlib.h>
@@ -15,12 +18,51 @@
 #define QUEUE_SIZE    128
 #define N             1000000
 #define QUIT          0XDEADBEEF
+#define STREAM        0XBEEF0000
+#define MAX_BURST     64
+
+static const unsigned int burst_sizes[] = {1, 4, 16, 64};
 
 struct params {
     struct lrpc_msg    *client_buf, *server_buf;
     uint32_t    *client_wb, *server_wb;
 };
 
+static void client_stream(struct lrpc_chan_out *c_out,
+              struct lrpc_chan_in *c_in, unsigned int burst)
+{
+    struct lrpc_msg msgs[MAX_BURST];
+    double msgs_per_second;
+    uint64_t start_us;
+    uint64_t cmd;
+    unsigned long payload;
+    unsigned int i, n, sent = 0;
+
+    /* tell the server how many messages to expect and at what burst size */
+    while (!lrpc_send(c_out, STREAM, burst))
+        cpu_relax();
+
+    start_us = microtime();
+
+    while (sent < N) {
+        n = libut_min(burst, N - sent);
+        for (i = 0; i < n; i++) {
+            msgs[i].cmd = sent + i;
+            msgs[i].payload = 0;
+        }
+        sent += lrpc_send_burst(c_out, msgs, n);
+    }
+
+    /* wait for the server to acknowledge the last message */
+    while (!lrpc_recv(c_in, &cmd, &payload))
+        cpu_relax();
+    BUG_ON(cmd != STREAM);
+
+    msgs_per_second = (double)N / ((microtime() - start_us) * 0.000001);
+    log_info("burst %3u: streamed %f messages / second", burst,
+         msgs_per_second);
+}
+
 static void client(struct params *p)
 {
     struct lrpc_chan_out c_out;
@@ -31,6 +73,8 @@ static void client(struct params *p)
     unsigned long payload;
     int ret, i;
 
+    BUILD_ASSERT(N < STREAM);
+
     ret = lrpc_init_out(&c_out, p->server_buf, QUEUE_SIZE, p->server_wb);
     BUG_ON(ret);
 
@@ -59,10 +103,35 @@ static void client(struct params *p)
     msgs_per_second = (double)N / ((microtime() - start_us) * 0.000001);
     log_info("echoed %f messages / second", msgs_per_second);
 
+    for (i = 0; i < ARRAY_SIZE(burst_sizes); i++)
+        client_stream(&c_out, &c_in, burst_sizes[i]);
+
     while (!lrpc_send(&c_out, QUIT, 0))
         cpu_relax();
 }
 
+static void server_stream(struct lrpc_chan_out *c_out,
+              struct lrpc_chan_in *c_in, unsigned int burst)
+{
+    struct lrpc_msg msgs[MAX_BURST];
+    unsigned int i, n, received = 0;
+
+    while (received < N) {
+        n = lrpc_recv_burst(c_in, msgs, burst);
+        if (!n) {
+            cpu_relax();
+            continue;
+        }
+
+        for (i = 0; i < n; i++)
+            BUG_ON(msgs[i].cmd != received + i);
+        received += n;
+    }
+
+    while (!lrpc_send(c_out, STREAM, 0))
+        cpu_relax();
+}
+
 static void server(struct params *p)
 {
     struct lrpc_chan_out c_out;
@@ -84,6 +153,11 @@ static void server(struct params *p)
         if (cmd == QUIT)
             break;
 
+        if (cmd == STREAM) {
+            server_stream(&c_out, &c_in, payload);
+            continue;
+        }
+
         while (!lrpc_send(&c_out, cmd, payload))
             cpu_relax();
     }
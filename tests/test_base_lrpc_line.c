@@ -0,0 +1,172 @@
+/*
+ * test_base_lrpc_line.c - tests LRPC messaging with inline message bodies
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <base/init.h>
+#include <base/log.h>
+#include <base/assert.h>
+#include <base/cpu.h>
+#include <base/lrpc.h>
+#include <base/time.h>
+
+#define QUEUE_SIZE    64
+#define N             1000000
+#define QUIT          0XDEADBEEF
+
+struct params {
+    struct lrpc_line    *client_buf, *server_buf;
+    uint32_t    *client_wb, *server_wb;
+};
+
+/* cycles through every message length, including multi-slot ones */
+static size_t msg_len(int i)
+{
+    return i % (LRPC_LINE_MAX_LEN + 1);
+}
+
+static void msg_fill(uint8_t *buf, int i, size_t len)
+{
+    size_t j;
+
+    for (j = 0; j < len; j++)
+        buf[j] = (uint8_t)(i + j);
+}
+
+static void client(struct params *p)
+{
+    struct lrpc_line_chan_out c_out;
+    struct lrpc_line_chan_in c_in;
+    uint8_t out[LRPC_LINE_MAX_LEN], in[LRPC_LINE_MAX_LEN];
+    double msgs_per_second;
+    uint64_t start_us, cmd;
+    size_t len, bytes = 0;
+    int ret, i;
+
+    ret = lrpc_line_init_out(&c_out, p->server_buf, QUEUE_SIZE, p->server_wb);
+    BUG_ON(ret);
+
+    ret = lrpc_line_init_in(&c_in, p->client_buf, QUEUE_SIZE, p->client_wb);
+    BUG_ON(ret);
+
+    start_us = microtime();
+
+    for (i = 0; i < N; i++) {
+        len = msg_len(i);
+        msg_fill(out, i, len);
+        while (!lrpc_line_send(&c_out, i, out, len))
+            cpu_relax();
+
+        while ((ret = lrpc_line_recv(&c_in, &cmd, in, sizeof(in))) ==
+               -EAGAIN)
+            cpu_relax();
+        BUG_ON(ret != len);
+        BUG_ON(cmd != i);
+        BUG_ON(memcmp(in, out, len));
+        bytes += len;
+    }
+
+    msgs_per_second = (double)N / ((microtime() - start_us) * 0.000001);
+    log_info("echoed %f messages / second (%ld bytes average)",
+             msgs_per_second, bytes / N);
+
+    while (!lrpc_line_send(&c_out, QUIT, NULL, 0))
+        cpu_relax();
+}
+
+static void server(struct params *p)
+{
+    struct lrpc_line_chan_out c_out;
+    struct lrpc_line_chan_in c_in;
+    uint8_t buf[LRPC_LINE_MAX_LEN];
+    uint64_t cmd;
+    int ret;
+
+    ret = lrpc_line_init_in(&c_in, p->server_buf, QUEUE_SIZE, p->server_wb);
+    BUG_ON(ret);
+
+    ret = lrpc_line_init_out(&c_out, p->client_buf, QUEUE_SIZE, p->client_wb);
+    BUG_ON(ret);
+
+    while (true) {
+        while ((ret = lrpc_line_recv(&c_in, &cmd, buf, sizeof(buf))) ==
+               -EAGAIN)
+            cpu_relax();
+        BUG_ON(ret < 0);
+
+        if (cmd == QUIT)
+            break;
+
+        while (!lrpc_line_send(&c_out, cmd, buf, ret))
+            cpu_relax();
+    }
+}
+
+static void *test_thread(void *data)
+{
+    int ret;
+
+    ret = base_init_thread();
+    if (ret) {
+        log_err("base_init_thread() failed, ret = %d", ret);
+        BUG();
+    }
+    BUG_ON(!thread_init_done);
+
+    server((struct params *)data);
+    return NULL;
+}
+
+static struct lrpc_line *alloc_ring(void)
+{
+    struct lrpc_line *tbl;
+
+    tbl = aligned_alloc(CACHE_LINE_SIZE, sizeof(*tbl) * QUEUE_SIZE);
+    BUG_ON(!tbl);
+    memset(tbl, 0, sizeof(*tbl) * QUEUE_SIZE);
+    return tbl;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t tid;
+    struct params p;
+    int ret;
+
+    ret = base_init();
+    if (ret) {
+        log_err("base_init() failed, ret = %d", ret);
+        return 1;
+    }
+    BUG_ON(!base_init_done);
+
+    ret = base_init_thread();
+    if (ret) {
+        log_err("base_init_thread() failed, ret = %d", ret);
+        BUG();
+    }
+    BUG_ON(!thread_init_done);
+
+    p.client_buf = alloc_ring();
+    p.server_buf = alloc_ring();
+
+    p.client_wb = malloc(CACHE_LINE_SIZE);
+    BUG_ON(!p.client_wb);
+    memset(p.client_wb, 0, CACHE_LINE_SIZE);
+
+    p.server_wb = malloc(CACHE_LINE_SIZE);
+    BUG_ON(!p.server_wb);
+    memset(p.server_wb, 0, CACHE_LINE_SIZE);
+
+    ret = pthread_create(&tid, NULL, test_thread, &p);
+    BUG_ON(ret);
+
+    client(&p);
+
+    ret = pthread_join(tid, NULL);
+    BUG_ON(ret);
+    return 0;
+}
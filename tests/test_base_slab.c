@@ -0,0 +1,168 @@
+/*
+ * test_base_slab.c - measures slab throughput as threads are added
+ *
+ * Each thread allocates batches of items, frees half of them itself and hands
+ * the other half to its neighbor to free, so both the local and the remote
+ * free paths are exercised. The locked and the scalable slab modes are run
+ * back to back for comparison.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include <base/init.h>
+#include <base/log.h>
+#include <base/assert.h>
+#include <base/cpu.h>
+#include <base/lock.h>
+#include <base/slab.h>
+#include <base/thread.h>
+#include <base/time.h>
+
+#define ITEM_SIZE    256
+#define BATCH        64
+#define ROUNDS       20000
+#define MAX_THREADS  16
+
+struct mailbox {
+    spinlock_t    lock;
+    int           nr;
+    void          *items[BATCH * 4];
+} __aligned(CACHE_LINE_SIZE);
+
+static struct slab *test_slab;
+static struct mailbox mailboxes[MAX_THREADS];
+static pthread_barrier_t barrier;
+static int nr_threads;
+
+static void drain_mailbox(struct mailbox *m)
+{
+    void *items[ARRAY_SIZE(m->items)];
+    int i, nr;
+
+    spin_lock(&m->lock);
+    nr = m->nr;
+    memcpy(items, m->items, nr * sizeof(void *));
+    m->nr = 0;
+    spin_unlock(&m->lock);
+
+    for (i = 0; i < nr; i++)
+        slab_free(test_slab, items[i]);
+}
+
+static void post_mailbox(struct mailbox *m, void *item)
+{
+    spin_lock(&m->lock);
+    if (m->nr < ARRAY_SIZE(m->items)) {
+        m->items[m->nr++] = item;
+        item = NULL;
+    }
+    spin_unlock(&m->lock);
+
+    /* the neighbor is behind, free it here instead */
+    if (item)
+        slab_free(test_slab, item);
+}
+
+static void run_rounds(int idx)
+{
+    struct mailbox *next = &mailboxes[(idx + 1) % nr_threads];
+    void *items[BATCH];
+    int i, j;
+
+    for (i = 0; i < ROUNDS; i++) {
+        for (j = 0; j < BATCH; j++) {
+            items[j] = slab_alloc(test_slab);
+            BUG_ON(!items[j]);
+            ACCESS_ONCE(*(int *)items[j]) = j;
+        }
+
+        for (j = 0; j < BATCH; j++) {
+            if (j & 1)
+                post_mailbox(next, items[j]);
+            else
+                slab_free(test_slab, items[j]);
+        }
+
+        drain_mailbox(&mailboxes[idx]);
+    }
+}
+
+static void *test_thread(void *arg)
+{
+    int idx = (int)(long)arg;
+    int ret;
+
+    ret = base_init_thread();
+    BUG_ON(ret);
+
+    pthread_barrier_wait(&barrier);
+    run_rounds(idx);
+    pthread_barrier_wait(&barrier);
+    drain_mailbox(&mailboxes[idx]);
+    return NULL;
+}
+
+static void run_test(struct slab *s, const char *name)
+{
+    pthread_t tid[MAX_THREADS];
+    uint64_t start_us, elapsed_us;
+    int i, ret;
+
+    test_slab = s;
+    for (i = 0; i < nr_threads; i++) {
+        spin_lock_init(&mailboxes[i].lock);
+        mailboxes[i].nr = 0;
+    }
+
+    ret = pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+    BUG_ON(ret);
+
+    for (i = 0; i < nr_threads; i++) {
+        ret = pthread_create(&tid[i], NULL, test_thread, (void *)(long)i);
+        BUG_ON(ret);
+    }
+
+    pthread_barrier_wait(&barrier);
+    start_us = microtime();
+    pthread_barrier_wait(&barrier);
+    elapsed_us = microtime() - start_us;
+
+    for (i = 0; i < nr_threads; i++) {
+        ret = pthread_join(tid[i], NULL);
+        BUG_ON(ret);
+    }
+    pthread_barrier_destroy(&barrier);
+
+    log_info("%s: %d threads, %f M alloc+free / second", name, nr_threads,
+             (double)nr_threads * ROUNDS * BATCH / elapsed_us);
+}
+
+int main(int argc, char *argv[])
+{
+    struct slab locked, scalable;
+    int ret;
+
+    ret = base_init();
+    if (ret) {
+        log_err("base_init() failed, ret = %d", ret);
+        return 1;
+    }
+
+    ret = base_init_thread();
+    BUG_ON(ret);
+
+    nr_threads = libut_min(cpu_count, MAX_THREADS);
+
+    ret = slab_create(&locked, "test_locked", ITEM_SIZE, 0);
+    BUG_ON(ret);
+    ret = slab_create(&scalable, "test_scalable", ITEM_SIZE,
+                      SLAB_FLAG_SCALABLE);
+    BUG_ON(ret);
+
+    run_test(&locked, "locked");
+    run_test(&scalable, "scalable");
+    slab_print_usage();
+
+    return 0;
+}
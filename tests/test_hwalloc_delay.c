@@ -0,0 +1,72 @@
+/*
+ * test_hwalloc_delay.c - checks hwallocd's RX queue delay estimate
+ *
+ * Feeds cores_rxq_delay_us() the queue indices seen at each interval and
+ * checks that the estimate grows while a stalled consumer leaves the queue
+ * non-empty, keeps up with the backlog behind a slow consumer, and resets
+ * once the queue drains.
+ */
+
+#include <stdio.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+
+#include "../hwalloc/defs.h"
+
+#define INTERVAL_US 5
+#define STEPS       100
+
+/* a consumer that stalls while messages keep arriving, from index @start */
+static void check_stalled(uint32_t start)
+{
+    uint32_t head = start, tail = start, since_head = 0;
+    uint64_t now = 1000, since_us = 0, delay;
+    int i;
+
+    for (i = 0; i < STEPS; i++) {
+        now += INTERVAL_US;
+        head++;
+        delay = cores_rxq_delay_us(head, tail, &since_head, &since_us, now);
+        BUG_ON(delay != (uint64_t)i * INTERVAL_US);
+    }
+
+    /* the consumer catches up */
+    now += INTERVAL_US;
+    delay = cores_rxq_delay_us(head, head, &since_head, &since_us, now);
+    BUG_ON(delay != 0);
+}
+
+/* a consumer that takes one message per interval while two arrive */
+static uint64_t check_slow(void)
+{
+    uint32_t head = 0, tail = 0, since_head = 0;
+    uint64_t now = 1000, since_us = 0, delay, worst = 0;
+    int i;
+
+    for (i = 0; i < STEPS; i++) {
+        now += INTERVAL_US;
+        head += 2;
+        delay = cores_rxq_delay_us(head, tail, &since_head, &since_us, now);
+        worst = libut_max(worst, delay);
+        tail++;
+    }
+
+    /* the backlog keeps growing, so the estimate should reach far back */
+    BUG_ON(worst < STEPS / 4 * INTERVAL_US);
+    return worst;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t worst;
+
+    check_stalled(0);
+    /* index wraparound doesn't confuse the estimate */
+    check_stalled(UINT32_MAX - STEPS / 2);
+    worst = check_slow();
+
+    printf("rx queue delay estimate ok, %lu us behind a slow consumer\n",
+           worst);
+    return 0;
+}
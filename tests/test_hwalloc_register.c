@@ -0,0 +1,73 @@
+/*
+ * test_hwalloc_register.c - registers and unregisters many runtimes with
+ * hwallocd at once
+ *
+ * Forks waves of short-lived runtimes that connect to hwallocd, run an empty
+ * main thread and exit, keeping more connections live at the same time than
+ * select() could handle (FD_SETSIZE). Requires a running hwallocd.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+
+#define NR_RUNTIMES 1280
+#define NR_WAVES    4
+#define HOLD_US     (50 * ONE_MS)
+
+static void main_handler(void *arg)
+{
+    /* hold the connection so registrations overlap */
+    timer_sleep(HOLD_US);
+}
+
+static pid_t spawn_runtime(const char *cfgpath)
+{
+    pid_t pid;
+
+    pid = fork();
+    if (pid != 0)
+        return pid;
+
+    exit(runtime_init(cfgpath, main_handler, NULL) ? EXIT_FAILURE : 0);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *cfgpath = (1 < argc) ? argv[1] : NULL;
+    uint64_t start_us, elapsed_us;
+    int i, wave, status, failed = 0;
+    pid_t pid;
+
+    start_us = microtime();
+    for (wave = 0; wave < NR_WAVES; wave++) {
+        for (i = 0; i < NR_RUNTIMES; i++) {
+            pid = spawn_runtime(cfgpath);
+            if (pid < 0) {
+                log_err("fork() failed at runtime %d", i);
+                return EXIT_FAILURE;
+            }
+        }
+
+        for (i = 0; i < NR_RUNTIMES; i++) {
+            pid = wait(&status);
+            BUG_ON(pid < 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                failed++;
+        }
+    }
+    elapsed_us = microtime() - start_us;
+
+    printf("%d runtimes in %d waves, %d failed, %f registrations / sec\n",
+           NR_RUNTIMES * NR_WAVES, NR_WAVES, failed,
+           (double)NR_RUNTIMES * NR_WAVES * ONE_SECOND / elapsed_us);
+
+    return failed ? EXIT_FAILURE : 0;
+}
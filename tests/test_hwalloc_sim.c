@@ -0,0 +1,82 @@
+/*
+ * test_hwalloc_sim.c - measures core allocation against an in-process hwallocd
+ *
+ * Starts the hwallocd from libhwalloc-sim.a on a helper thread, then issues
+ * bursts of busy threads separated by idle gaps, so each burst has to be
+ * scaled out across kthreads again. Needs no separately started hwallocd.
+ * Extra arguments after the config file are passed on as hwallocd options.
+ */
+
+#include <stdio.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <hwalloc/sim.h>
+#include <runtime/thread.h>
+#include <runtime/sync.h>
+#include <runtime/timer.h>
+
+#define BURSTS       200
+#define BURST_SIZE   32
+#define WORK_US      50
+#define IDLE_US      (5 * ONE_MS)
+
+static void work_handler(void *arg)
+{
+    waitgroup_t *wg = (waitgroup_t *)arg;
+
+    delay_us(WORK_US);
+    waitgroup_done(wg);
+}
+
+static void main_handler(void *arg)
+{
+    uint64_t start_us, total_us = 0, worst_us = 0, elapsed_us;
+    waitgroup_t wg;
+    int i, j, ret;
+
+    for (i = 0; i < BURSTS; i++) {
+        /* let the hwallocd reclaim our cores between bursts */
+        timer_sleep(IDLE_US);
+
+        waitgroup_init(&wg);
+        waitgroup_add(&wg, BURST_SIZE);
+        start_us = microtime();
+        for (j = 0; j < BURST_SIZE; j++) {
+            ret = thread_spawn(work_handler, &wg);
+            BUG_ON(ret);
+        }
+        waitgroup_wait(&wg);
+
+        elapsed_us = microtime() - start_us;
+        total_us += elapsed_us;
+        if (elapsed_us > worst_us)
+            worst_us = elapsed_us;
+    }
+
+    log_info("%d bursts of %d x %d us: %lu us average, %lu us worst",
+             BURSTS, BURST_SIZE, WORK_US, total_us / BURSTS, worst_us);
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    if (2 < argc)
+        ret = hwalloc_sim_start(argc - 2, &argv[2]);
+    else
+        ret = hwalloc_sim_start(0, NULL);
+    if (ret) {
+        printf("failed to start the in-process hwallocd\n");
+        return ret;
+    }
+
+    ret = runtime_init((1 < argc) ? argv[1] : NULL, main_handler, NULL);
+    if (ret) {
+        printf("failed to start runtime\n");
+        return ret;
+    }
+
+    return 0;
+}
@@ -1,5 +1,10 @@
 /*
  * test_kthread_wakeup.c - tests waking of kthreads
+ *
+ * Also measures park-then-unpark latency: a lone thread sleeps briefly so
+ * every kthread parks, and the overshoot past each deadline is the cost of
+ * the hwallocd waking a kthread. Compare runs with and without
+ * "runtime_park_futex" in the config file.
  */
 
 #include <stdio.h>
@@ -10,10 +15,12 @@
 #include <base/atomic.h>
 #include <runtime/thread.h>
 #include <runtime/sync.h>
+#include <runtime/timer.h>
 
 #define NTHREADS    6
 #define N           500000
 #define SPAWN_LIMIT 5
+#define PARK_ROUNDS 2000
 
 atomic_t n_threads;
 atomic_t n_spawned;
@@ -48,6 +55,23 @@ static void work_handler(void *arg)
     waitgroup_done(wg_parent);
 }
 
+static void measure_park_latency(uint64_t sleep_us)
+{
+    uint64_t deadline, late, total = 0, worst = 0;
+    int i;
+
+    for (i = 0; i < PARK_ROUNDS; i++) {
+        deadline = microtime() + sleep_us;
+        timer_sleep_until(deadline);
+        late = microtime() - deadline;
+        total += late;
+        worst = libut_max(worst, late);
+    }
+
+    log_info("sleep %lu us: woke %f us late on average, %lu us worst",
+             sleep_us, (double)total / PARK_ROUNDS, worst);
+}
+
 static void main_handler(void *arg)
 {
     int i, ret;
@@ -67,6 +91,10 @@ static void main_handler(void *arg)
 
     waitgroup_wait(&wg);
     log_info("ran %d threads", N);
+
+    measure_park_latency(10);
+    measure_park_latency(50);
+    measure_park_latency(200);
 }
 
 int main(int argc, char *argv[])
@@ -0,0 +1,111 @@
+/*
+ * test_preempt_latency.c - measures how quickly hwallocd can take a core back
+ *
+ * Usage: test_preempt_latency <system cfg> <batch cfg> [spin]
+ *
+ * A forked runtime configured with "runtime_priority batch" keeps every core
+ * it can get busy, while this runtime ("runtime_priority system") repeatedly
+ * sleeps briefly. Each wakeup has to preempt a batch kthread, so the overshoot
+ * past the deadline is the preemption latency. The batch threads reach a
+ * preemption point every microsecond, so the shared preempt flag is honored;
+ * with "spin" they never do and every preemption falls back to SIGUSR1.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/preempt.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+
+#define NHOGS        64
+#define ROUNDS       2000
+#define SLEEP_US     100
+#define WARMUP_US    (100 * ONE_MS)
+
+static bool hog_spin;
+static pid_t hog_pid;
+
+static void hog_handler(void *arg)
+{
+    for (;;) {
+        if (hog_spin) {
+            delay_us(ONE_MS);
+            continue;
+        }
+
+        preempt_disable();
+        delay_us(1);
+        preempt_enable();
+    }
+}
+
+static void hog_main_handler(void *arg)
+{
+    int i, ret;
+
+    for (i = 1; i < NHOGS; i++) {
+        ret = thread_spawn(hog_handler, NULL);
+        BUG_ON(ret);
+    }
+
+    hog_handler(NULL);
+}
+
+static void main_handler(void *arg)
+{
+    uint64_t start_us, overshoot_us, total_us = 0, worst_us = 0;
+    int i;
+
+    /* let the batch runtime take over the idle cores */
+    timer_sleep(WARMUP_US);
+
+    for (i = 0; i < ROUNDS; i++) {
+        start_us = microtime();
+        timer_sleep(SLEEP_US);
+        overshoot_us = microtime() - start_us - SLEEP_US;
+        total_us += overshoot_us;
+        if (overshoot_us > worst_us)
+            worst_us = overshoot_us;
+    }
+
+    log_info("%s batch threads: %f us average wakeup overshoot, %lu us worst",
+             hog_spin ? "spinning" : "cooperative",
+             (double)total_us / ROUNDS, worst_us);
+
+    kill(hog_pid, SIGKILL);
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    if (argc < 3) {
+        printf("usage: %s <system cfg> <batch cfg> [spin]\n", argv[0]);
+        return -EINVAL;
+    }
+    hog_spin = argc > 3 && !strcmp(argv[3], "spin");
+
+    hog_pid = fork();
+    if (hog_pid < 0) {
+        log_err("fork() failed");
+        return -errno;
+    }
+    if (hog_pid == 0)
+        exit(runtime_init(argv[2], hog_main_handler, NULL));
+
+    ret = runtime_init(argv[1], main_handler, NULL);
+    if (ret) {
+        kill(hog_pid, SIGKILL);
+        printf("failed to start runtime\n");
+        return ret;
+    }
+
+    return 0;
+}
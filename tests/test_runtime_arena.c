@@ -0,0 +1,82 @@
+/*
+ * test_runtime_arena.c - tests uthread-scoped arena allocations
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/arena.h>
+#include <runtime/thread.h>
+#include <runtime/sync.h>
+
+#define N          100000
+#define NALLOCS    64
+#define ALLOC_SIZE 200
+
+static void fill_arena(void)
+{
+    char *p;
+    int i;
+
+    for (i = 0; i < NALLOCS; i++) {
+        p = ut_arena_alloc(ALLOC_SIZE);
+        BUG_ON(!p);
+        BUG_ON((uintptr_t)p % UT_ARENA_ALIGN);
+        memset(p, i, ALLOC_SIZE);
+    }
+
+    p = ut_arena_alloc_aligned(8, CACHE_LINE_SIZE);
+    BUG_ON(!p || (uintptr_t)p % CACHE_LINE_SIZE);
+    BUG_ON(ut_arena_alloc(UT_ARENA_MAX_ALLOC + 1));
+}
+
+static void leaf_handler(void *arg)
+{
+    waitgroup_t *wg_parent = (waitgroup_t *)arg;
+
+    fill_arena();
+    ut_arena_reset();
+
+    /* these pages are reclaimed by thread_exit() */
+    fill_arena();
+    waitgroup_done(wg_parent);
+}
+
+static void main_handler(void *arg)
+{
+    waitgroup_t wg;
+    uint64_t start_us;
+    int i, ret;
+
+    log_info("started main_handler() thread");
+    log_info("spawning %d threads with %d arena allocations each",
+             N, NALLOCS);
+
+    waitgroup_init(&wg);
+    waitgroup_add(&wg, N);
+    start_us = microtime();
+    for (i = 0; i < N; i++) {
+        ret = thread_spawn(leaf_handler, &wg);
+        BUG_ON(ret);
+        thread_yield();
+    }
+
+    waitgroup_wait(&wg);
+    log_info("%f us / thread", (double)(microtime() - start_us) / N);
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    ret = runtime_init((1 < argc) ? argv[1] : NULL, main_handler, NULL);
+    if (ret) {
+        printf("failed to start runtime\n");
+        return ret;
+    }
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * test_runtime_hol.c - measures head-of-line blocking behind a long uthread
+ *
+ * A CPU-bound request is spawned ahead of a batch of short ones. Without time
+ * slices the short requests wait for the long one to finish; with
+ * "runtime_quantum_us <n>" (or "auto") in the config file they wait about one
+ * quantum. Use "runtime_kthreads 1" so the short requests can't simply be
+ * stolen by another kthread. With "runtime_quantum_cooperative" the long
+ * request only yields at safepoints, so build with SAFEPOINTS=1.
+ */
+
+#include <stdio.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/thread.h>
+#include <runtime/sync.h>
+
+#define ROUNDS      20
+#define NSHORT      16
+#define LONG_US     (20 * ONE_MS)
+#define SHORT_US    10
+#define CHUNK_US    10
+
+struct request {
+    waitgroup_t *wg;
+    uint64_t    spawn_us;
+    uint64_t    done_us;
+};
+
+/* a call boundary for SAFEPOINTS=1 builds to instrument */
+static __noinline void long_chunk(void)
+{
+    delay_us(CHUNK_US);
+}
+
+static void long_handler(void *arg)
+{
+    waitgroup_t *wg = (waitgroup_t *)arg;
+    int i;
+
+    /* never reaches a preemption point unless built with safepoints */
+    for (i = 0; i < LONG_US / CHUNK_US; i++)
+        long_chunk();
+    waitgroup_done(wg);
+}
+
+static void short_handler(void *arg)
+{
+    struct request *req = (struct request *)arg;
+
+    delay_us(SHORT_US);
+    req->done_us = microtime();
+    waitgroup_done(req->wg);
+}
+
+static void main_handler(void *arg)
+{
+    struct request reqs[NSHORT];
+    uint64_t latency_us, total_us = 0, worst_us = 0;
+    waitgroup_t wg;
+    int i, j, ret;
+
+    for (i = 0; i < ROUNDS; i++) {
+        waitgroup_init(&wg);
+        waitgroup_add(&wg, NSHORT + 1);
+
+        /* queue the long request first, the short ones behind it */
+        ret = thread_spawn(long_handler, &wg);
+        BUG_ON(ret);
+        for (j = 0; j < NSHORT; j++) {
+            reqs[j].wg = &wg;
+            reqs[j].spawn_us = microtime();
+            ret = thread_spawn(short_handler, &reqs[j]);
+            BUG_ON(ret);
+        }
+        waitgroup_wait(&wg);
+
+        for (j = 0; j < NSHORT; j++) {
+            latency_us = reqs[j].done_us - reqs[j].spawn_us;
+            total_us += latency_us;
+            if (latency_us > worst_us)
+                worst_us = latency_us;
+        }
+    }
+
+    log_info("%d us requests behind a %d us one: %lu us average, %lu us worst",
+             SHORT_US, LONG_US, total_us / (ROUNDS * NSHORT), worst_us);
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    ret = runtime_init((1 < argc) ? argv[1] : NULL, main_handler, NULL);
+    if (ret) {
+        printf("failed to start runtime\n");
+        return ret;
+    }
+
+    return 0;
+}
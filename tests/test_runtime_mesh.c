@@ -0,0 +1,128 @@
+/*
+ * test_runtime_mesh.c - tests posting closures to specific kthreads
+ *
+ * Measures post throughput, then lets the other kthreads park and checks
+ * that closures posted to them still run.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include <base/stddef.h>
+#include <base/atomic.h>
+#include <base/limits.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/thread.h>
+#include <runtime/sync.h>
+#include <runtime/timer.h>
+
+#define N           1000000
+#define PARK_WAIT_US    (50 * ONE_MS)
+#define RUN_TIMEOUT_US  ONE_SECOND
+
+struct target {
+    pthread_t      owner;
+    unsigned long  runs;
+    unsigned long  moved;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct target targets[NCPU];
+static waitgroup_t wg;
+static atomic_t parked_runs;
+
+static void post_handler(void *arg)
+{
+    struct target *t = (struct target *)arg;
+
+    /* racy if a parked kthread's closures are stolen, fine for a report */
+    if (!t->runs++)
+        t->owner = pthread_self();
+    else if (t->owner != pthread_self())
+        t->moved++;
+
+    waitgroup_done(&wg);
+}
+
+static void probe_handler(void *arg)
+{
+}
+
+static void parked_post_handler(void *arg)
+{
+    atomic_inc(&parked_runs);
+}
+
+/* posts to every kthread once they had time to park, returns how many ran */
+static int post_to_parked(int nrks)
+{
+    uint64_t start_us;
+    int i, ret;
+
+    timer_sleep(PARK_WAIT_US);
+
+    for (i = 0; i < nrks; i++) {
+        ret = kthread_post(i, parked_post_handler, NULL);
+        BUG_ON(ret);
+    }
+
+    /* nothing wakes a parked kthread for us, the posts must run anyway */
+    start_us = microtime();
+    while (atomic_read(&parked_runs) < nrks &&
+           microtime() - start_us < RUN_TIMEOUT_US)
+        timer_sleep(ONE_MS);
+
+    return atomic_read(&parked_runs);
+}
+
+static void main_handler(void *arg)
+{
+    uint64_t start_us;
+    int i, ret, nrks;
+
+    log_info("started main_handler() thread");
+
+    /* count the kthreads, the probes aren't part of the measurement */
+    for (nrks = 0; nrks < NCPU; nrks++) {
+        if (kthread_post(nrks, probe_handler, NULL) == -EINVAL)
+            break;
+    }
+    BUG_ON(nrks == 0);
+    log_info("posting %d closures to %d kthreads", N, nrks);
+
+    waitgroup_init(&wg);
+    waitgroup_add(&wg, N);
+    start_us = microtime();
+    for (i = 0; i < N; i++) {
+        while ((ret = kthread_post(i % nrks, post_handler,
+                                   &targets[i % nrks])) == -EAGAIN)
+            thread_yield();
+        BUG_ON(ret);
+    }
+
+    waitgroup_wait(&wg);
+    log_info("%f posts / second",
+             (double)N / ((microtime() - start_us) * 0.000001));
+
+    for (i = 0; i < nrks; i++) {
+        log_info("kthread %d: %ld closures, %ld ran off the target kthread",
+                 i, targets[i].runs, targets[i].moved);
+    }
+
+    ret = post_to_parked(nrks);
+    log_info("%d of %d closures posted to parked kthreads ran", ret, nrks);
+    BUG_ON(ret != nrks);
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    ret = runtime_init((1 < argc) ? argv[1] : NULL, main_handler, NULL);
+    if (ret) {
+        printf("failed to start runtime\n");
+        return ret;
+    }
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * test_runtime_stack.c - tests growable uthread stacks
+ *
+ * Needs growable stacks, e.g. "runtime_stack_commit_kb 16" in the config
+ * file. Threads recurse far below the committed part of their stacks, then
+ * exit in large enough batches that their stacks are shrunk and reused.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/thread.h>
+#include <runtime/sync.h>
+
+#include "../runtime/defs.h"
+
+#define ROUNDS      8
+#define NTHREADS    256
+#define FRAME_SIZE  (1 * KB)
+#define DEPTH       96
+#define BUF_SIZE    (64 * KB)
+
+/* each frame keeps a pattern on the stack and checks it on the way back */
+static void __attribute__((noinline)) recurse(int depth)
+{
+    volatile char frame[FRAME_SIZE];
+    int i;
+
+    for (i = 0; i < FRAME_SIZE; i++)
+        frame[i] = (char)(depth + i);
+
+    if (depth > 0)
+        recurse(depth - 1);
+    else
+        thread_yield(); /* keep the other threads' stacks grown too */
+
+    for (i = 0; i < FRAME_SIZE; i++)
+        BUG_ON(frame[i] != (char)(depth + i));
+}
+
+static void deep_handler(void *arg)
+{
+    waitgroup_t *wg = (waitgroup_t *)arg;
+
+    recurse(DEPTH);
+    waitgroup_done(wg);
+}
+
+struct buf_args {
+    waitgroup_t *wg;
+    char        data[BUF_SIZE];
+};
+
+static void buf_handler(void *arg)
+{
+    struct buf_args *args = (struct buf_args *)arg;
+    int i;
+
+    for (i = 0; i < BUF_SIZE; i++)
+        BUG_ON(args->data[i] != (char)i);
+
+    /* the buffer already took most of the stack, grow the rest */
+    recurse(DEPTH - BUF_SIZE / FRAME_SIZE - 8);
+    waitgroup_done(args->wg);
+}
+
+static void check_with_buf(void)
+{
+    struct buf_args *args;
+    waitgroup_t wg;
+    thread_t *th;
+    int i;
+
+    waitgroup_init(&wg);
+    waitgroup_add(&wg, 1);
+
+    /* the buffer is written here, not by the new thread */
+    th = thread_create_with_buf(buf_handler, (void **)&args, sizeof(*args));
+    BUG_ON(!th);
+    args->wg = &wg;
+    for (i = 0; i < BUF_SIZE; i++)
+        args->data[i] = (char)i;
+    thread_ready(th);
+
+    waitgroup_wait(&wg);
+}
+
+static void main_handler(void *arg)
+{
+    waitgroup_t wg;
+    int i, j, ret;
+
+    if (!stack_commit_size)
+        log_warn("growable stacks are disabled, set runtime_stack_commit_kb");
+    BUG_ON(DEPTH * FRAME_SIZE <= stack_commit_size);
+
+    for (i = 0; i < ROUNDS; i++) {
+        waitgroup_init(&wg);
+        waitgroup_add(&wg, NTHREADS);
+        for (j = 0; j < NTHREADS; j++) {
+            ret = thread_spawn(deep_handler, &wg);
+            BUG_ON(ret);
+        }
+        waitgroup_wait(&wg);
+
+        check_with_buf();
+    }
+
+    log_info("%d threads grew their stacks to %d KB", ROUNDS * NTHREADS,
+             DEPTH * FRAME_SIZE / KB);
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    ret = runtime_init((1 < argc) ? argv[1] : NULL, main_handler, NULL);
+    if (ret) {
+        printf("failed to start runtime\n");
+        return ret;
+    }
+
+    return 0;
+}
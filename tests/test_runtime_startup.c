@@ -0,0 +1,77 @@
+/*
+ * test_runtime_startup.c - measures runtime startup and idle wakeup latency
+ *
+ * Run once against hwallocd and once with "runtime_dedicated_cores <list>"
+ * in the config file to compare the two ways kthreads get their cores. Needs
+ * at least two kthreads: the main thread spins while a parked kthread has to
+ * be woken to run the spawned thread.
+ */
+
+#include <stdio.h>
+
+#include <base/stddef.h>
+#include <base/atomic.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+
+#define WAKE_ROUNDS 1000
+#define IDLE_US     200
+
+static uint64_t init_start_us;
+
+struct wake_arg {
+    bool        ran;
+    uint64_t    spawn_tsc;
+    uint64_t    delay_cycles;
+};
+
+static void wake_handler(void *arg)
+{
+    struct wake_arg *w = (struct wake_arg *)arg;
+
+    w->delay_cycles += libut_rdtsc() - w->spawn_tsc;
+    store_release(&w->ran, true);
+}
+
+static void main_handler(void *arg)
+{
+    struct wake_arg w;
+    int i, ret;
+
+    log_info("%lu us from runtime_init() to the main thread",
+             microtime() - init_start_us);
+
+    /* spawn after letting the other kthreads park each round */
+    w.delay_cycles = 0;
+    for (i = 0; i < WAKE_ROUNDS; i++) {
+        timer_sleep(IDLE_US);
+
+        w.ran = false;
+        w.spawn_tsc = libut_rdtsc();
+        ret = thread_spawn(wake_handler, &w);
+        BUG_ON(ret);
+
+        /* keep this kthread busy so another one must run the thread */
+        while (!load_acquire(&w.ran))
+            cpu_relax();
+    }
+
+    log_info("%f us from spawn to run after idling",
+             (double)w.delay_cycles / cycles_per_us / WAKE_ROUNDS);
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    init_start_us = microtime();
+    ret = runtime_init((1 < argc) ? argv[1] : NULL, main_handler, NULL);
+    if (ret) {
+        printf("failed to start runtime\n");
+        return ret;
+    }
+
+    return 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * test_runtime_switch.c - measures context switch cost among many uthreads
+ *
+ * Run once with the default stacks and once with "runtime_stack_hugepage 1"
+ * in the config file to compare dTLB misses per switch. Also reports the cost
+ * of a bare switch between two threads, through thread_yield() and through
+ * condvar_signal_and_swap(), for threads that keep all floating point state
+ * and for integer-only ones; use "runtime_kthreads 1" so both threads stay on
+ * the same kthread.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <base/stddef.h>
+#include <base/limits.h>
+#include <base/lock.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/thread.h>
+#include <runtime/sync.h>
+
+#define NTHREADS    4096
+#define ROUNDS      200
+#define STACK_TOUCH 512
+#define PAIR_ROUNDS 1000000
+
+static DEFINE_SPINLOCK(perf_lock);
+static int perf_fds[NCPU];
+static int nr_perf_fds;
+
+/* opens a dTLB load miss counter for the calling kthread */
+static int perf_init_thread(void)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+        log_warn("perf_event_open() failed, dTLB misses won't be reported");
+        return 0;
+    }
+
+    spin_lock(&perf_lock);
+    perf_fds[nr_perf_fds++] = fd;
+    spin_unlock(&perf_lock);
+    return 0;
+}
+
+static void perf_control(unsigned long op)
+{
+    int i;
+
+    for (i = 0; i < nr_perf_fds; i++)
+        ioctl(perf_fds[i], op, 0);
+}
+
+static uint64_t perf_read_total(void)
+{
+    uint64_t total = 0, val;
+    int i;
+
+    for (i = 0; i < nr_perf_fds; i++) {
+        if (read(perf_fds[i], &val, sizeof(val)) == sizeof(val))
+            total += val;
+    }
+
+    return total;
+}
+
+static void work_handler(void *arg)
+{
+    waitgroup_t *wg_parent = (waitgroup_t *)arg;
+    char buf[STACK_TOUCH];
+    int i;
+
+    for (i = 0; i < ROUNDS; i++) {
+        /* touch the stack so each switch has a TLB footprint */
+        ACCESS_ONCE(buf[i % STACK_TOUCH]) = i;
+        thread_yield();
+    }
+
+    waitgroup_done(wg_parent);
+}
+
+static void yield_handler(void *arg)
+{
+    waitgroup_t *wg_parent = (waitgroup_t *)arg;
+    int i;
+
+    for (i = 0; i < PAIR_ROUNDS; i++)
+        thread_yield();
+
+    waitgroup_done(wg_parent);
+}
+
+static mutex_t swap_lock;
+static condvar_t swap_cv;
+static bool swap_stop;
+static int swap_served;
+
+static void swap_server_handler(void *arg)
+{
+    waitgroup_t *wg_parent = (waitgroup_t *)arg;
+
+    mutex_lock(&swap_lock);
+    while (!swap_stop) {
+        condvar_wait(&swap_cv, &swap_lock);
+        swap_served++;
+    }
+    mutex_unlock(&swap_lock);
+
+    waitgroup_done(wg_parent);
+}
+
+static void swap_client_handler(void *arg)
+{
+    waitgroup_t *wg_parent = (waitgroup_t *)arg;
+
+    /* a no-op until the server waits, then a direct switch to it */
+    while (ACCESS_ONCE(swap_served) < PAIR_ROUNDS)
+        condvar_signal_and_swap(&swap_cv);
+
+    mutex_lock(&swap_lock);
+    swap_stop = true;
+    condvar_signal(&swap_cv);
+    mutex_unlock(&swap_lock);
+
+    waitgroup_done(wg_parent);
+}
+
+/* times two threads switching back and forth, returns ns / switch */
+static double time_pair(thread_fn_t fn_a, thread_fn_t fn_b, int fp_mode,
+                        double nswitches)
+{
+    waitgroup_t wg;
+    uint64_t start_us;
+    thread_t *th_a, *th_b;
+
+    waitgroup_init(&wg);
+    waitgroup_add(&wg, 2);
+
+    start_us = microtime();
+    th_a = thread_create_fp(fn_a, &wg, fp_mode);
+    BUG_ON(!th_a);
+    th_b = thread_create_fp(fn_b, &wg, fp_mode);
+    BUG_ON(!th_b);
+    thread_ready(th_a);
+    thread_ready(th_b);
+    waitgroup_wait(&wg);
+
+    return (microtime() - start_us) * 1000 / nswitches;
+}
+
+static void time_pairs(int fp_mode, const char *name)
+{
+    log_info("%s thread_yield(): %f ns / switch", name,
+             time_pair(yield_handler, yield_handler, fp_mode,
+                       2.0 * PAIR_ROUNDS));
+
+    /* each round is a direct switch to the server and a scheduled one back */
+    mutex_init(&swap_lock);
+    condvar_init(&swap_cv);
+    swap_stop = false;
+    swap_served = 0;
+    log_info("%s condvar_signal_and_swap(): %f ns / switch", name,
+             time_pair(swap_server_handler, swap_client_handler, fp_mode,
+                       2.0 * PAIR_ROUNDS));
+}
+
+static void main_handler(void *arg)
+{
+    waitgroup_t wg;
+    uint64_t start_us, elapsed_us, misses;
+    double nswitches;
+    int i, ret;
+
+    log_info("started main_handler() thread");
+    log_info("yielding among %d threads, %d rounds each", NTHREADS, ROUNDS);
+
+    waitgroup_init(&wg);
+    waitgroup_add(&wg, NTHREADS);
+
+    perf_control(PERF_EVENT_IOC_RESET);
+    perf_control(PERF_EVENT_IOC_ENABLE);
+    start_us = microtime();
+    for (i = 0; i < NTHREADS; i++) {
+        ret = thread_spawn(work_handler, &wg);
+        BUG_ON(ret);
+    }
+
+    waitgroup_wait(&wg);
+    elapsed_us = microtime() - start_us;
+    perf_control(PERF_EVENT_IOC_DISABLE);
+    misses = perf_read_total();
+
+    nswitches = (double)NTHREADS * ROUNDS;
+    log_info("%f ns / switch", elapsed_us * 1000 / nswitches);
+    if (nr_perf_fds)
+        log_info("%f dTLB load misses / switch", misses / nswitches);
+
+    time_pairs(THREAD_FP_FULL, "full FP state");
+    time_pairs(THREAD_FP_NONE, "no FP state");
+}
+
+int main(int argc, char *argv[])
+{
+    int ret;
+
+    ret = runtime_set_initializers(NULL, perf_init_thread, NULL);
+    BUG_ON(ret);
+
+    ret = runtime_init((1 < argc) ? argv[1] : NULL, main_handler, NULL);
+    if (ret) {
+        printf("failed to start runtime\n");
+        return ret;
+    }
+
+    return 0;
+}